@@ -0,0 +1,291 @@
+/* buddy.c
+ *
+ * Description:
+ *   Implement buddy system for memory management
+ *
+ * Idea & part of the code are from https://github.com/wuwenbin/buddy2 
+ */
+
+// #include <stdio.h>
+// #include <assert.h>
+// #include <stdlib.h>
+// #include <string.h>
+// #include <stdbool.h>
+
+// #include "types.h"
+#include "buddy_system.h"
+
+static inline int left_child(int index)
+{
+    /* index * 2 + 1 */
+    return ((index << 1) + 1); 
+}
+
+static inline int right_child(int index)
+{
+    /* index * 2 + 2 */
+    return ((index << 1) + 2);
+}
+
+static inline int parent(int index)
+{
+    /* (index+1)/2 - 1 */
+    return (((index+1)>>1) - 1);
+}
+
+static inline int is_power_of_2(int index)
+{
+    return !(index & (index - 1));
+}
+
+#define max(a, b) (((a)>(b))?(a):(b))
+#define min(a, b) (((a)<(b))?(a):(b))
+
+/* a wrapper for free */
+static void b_free(void *addr)
+{
+    // free(addr);
+}
+
+/* the encoded order of the smallest block holding *size* fragments */
+static inline uint8_t order_fit(unsigned size)
+{
+    uint8_t order = 1;
+
+    while ((1u << (order - 1)) < size) {
+        order++;
+    }
+    return order;
+}
+
+/** allocate a new buddy structure 
+ * @param num_of_fragments number of fragments of the memory to be managed,
+ *        not necessarily a power of 2
+ * @return pointer to the allocated buddy structure */
+struct buddy *buddy_new(unsigned num_of_fragments, uint32_t heap_start)
+{
+    struct buddy *self = 0;
+    uint8_t node_order;
+    unsigned size, first;
+
+    int i;
+
+    if (num_of_fragments < 1) {
+        return 0;
+    }
+
+    /* alloacte an array to represent a complete binary tree */
+    self = (struct buddy *) heap_start;
+    // uint32_t heap_end = heap_start + sizeof(struct buddy) + 
+    //                     2 * num_of_fragments * sizeof(uint32_t);
+
+    size = 1 << (order_fit(num_of_fragments) - 1);
+    self->size = size;
+    self->avail = num_of_fragments;
+    self->used = 0;
+    self->peak = 0;
+
+    /* leaves past the end of the memory have no free fragment */
+    for (i = 0; i < size; i++) {
+        self->longest[size - 1 + i] = (i < num_of_fragments) ? 1 : 0;
+    }
+
+    /* fill the tree bottom up, level by level: first is the index of the
+     * first node on the level below the one being filled */
+    node_order = 1;
+    for (first = size - 1; first > 0; first = parent(first)) {
+        for (i = parent(first); i < first; i++) {
+            uint8_t l = self->longest[left_child(i)];
+            uint8_t r = self->longest[right_child(i)];
+
+            if (l == node_order && r == node_order) {
+                self->longest[i] = node_order + 1;
+            } else {
+                self->longest[i] = max(l, r);
+            }
+        }
+        node_order++;
+    }
+
+    return self;
+}
+
+void buddy_destory(struct buddy *self)
+{
+    b_free(self);
+}
+
+/* choose the child with smaller longest value which is still larger
+ * than *order* */
+unsigned choose_better_child(struct buddy *self, unsigned index, uint8_t order)
+{
+    unsigned left = left_child(index);
+    uint8_t l = self->longest[left];
+    uint8_t r = self->longest[left + 1];
+
+    if (l <= r) {
+        return (order > l) ? left + 1 : left;
+    }
+    return (order > r) ? left : left + 1;
+}
+
+/** allocate *size* from a buddy system *self* 
+ * @return the offset from the beginning of memory to be managed */
+int buddy_alloc(struct buddy *self, uint32_t size)
+{
+    if (self == 0 || size == 0 || self->size < size) {
+        return -1;
+    }
+    uint8_t order = order_fit(size);
+    size = 1 << (order - 1);
+
+    unsigned index = 0;
+    if (self->longest[index] < order) {
+        return -1;
+    }
+
+    /* search recursively for the child */
+    unsigned node_size = 0;
+    for (node_size = self->size; node_size != size; node_size >>= 1) {
+        /* choose the child with smaller longest value which is still larger
+         * than *size* */
+        index = choose_better_child(self, index, order);
+    }
+
+    /* update the *longest* value back */
+    self->longest[index] = 0;
+    self->used += node_size;
+    if (self->used > self->peak) {
+        self->peak = self->used;
+    }
+    int offset = (index + 1)*node_size - self->size;
+
+    while (index) {
+        index = parent(index);
+        self->longest[index] = 
+            max(self->longest[left_child(index)],
+                self->longest[right_child(index)]);
+    }
+
+    return offset;
+}
+
+void buddy_free(struct buddy *self, int offset)
+{
+    if (self == 0 || offset < 0 || offset >= self->avail) {
+        return;
+    }
+
+    uint32_t node_size;
+    uint8_t node_order;
+    unsigned index;
+
+    /* get the corresponding index from offset */
+    node_size = 1;
+    node_order = 1;
+    index = offset + self->size - 1;
+
+    for (; self->longest[index] != 0; index = parent(index)) {
+        node_size <<= 1;    /* node_size *= 2; */
+        node_order++;
+
+        if (index == 0) {
+            break;
+        }
+    }
+
+    /* offset is not the start of an allocated block */
+    if (self->longest[index] != 0 || (offset & (node_size - 1))) {
+        return;
+    }
+
+    self->longest[index] = node_order;
+    self->used -= node_size;
+
+    while (index) {
+        index = parent(index);
+
+        uint8_t left_longest = self->longest[left_child(index)];
+        uint8_t right_longest = self->longest[right_child(index)];
+
+        /* both halves entirely free, merge them */
+        if (left_longest == node_order && right_longest == node_order) {
+            self->longest[index] = node_order + 1;
+        } else {
+            self->longest[index] = max(left_longest, right_longest);
+        }
+        node_order++;
+    }
+}
+
+void buddy_dump(struct buddy *self)
+{   
+    printf("*** Page Map ***");
+
+    int len = self->size << 1;
+    int max_col = self->size << 1; 
+    int level = 0;
+    int i,j;
+
+    char cs[] = {'/', '\\'};
+    int idx = 0;
+    char c;
+
+    for (i = 0, max_col=len, level=0; i < len-1; i++) {
+        if (is_power_of_2(i+1)) {
+            max_col >>= 1;
+            level ++;
+            idx = 0;
+            printf("\n\t%d(%.2dK): ", level, max_col);
+        }
+
+        for (int k = 0; k < max_col - 1; k++)
+            printf(" ");
+        printf("%d", self->longest[i] ? 1 << (self->longest[i] - 1) : 0);
+    }
+
+    for (i = 0, max_col=len, level=0; i < len-1; i++) {
+        if (is_power_of_2(i+1)) {
+            max_col >>= 1;
+            level ++;
+            idx = 0;
+            printf("\n\t%d(%.2dK): ", level, max_col);
+        }
+
+        if (self->longest[i] > 0) {
+            c = '-';
+        } else {
+            c = cs[idx];
+            idx ^= 0x1;
+        }
+
+        for (j = 0; j < max_col; j++) {
+            printf("%c", c);
+        }
+    }
+    printf("\n\n");
+}
+
+int buddy_size(struct buddy *self, int offset)
+{
+    if (self == 0 || offset < 0 || offset >= self->avail) {
+        return 0;
+    }
+
+    unsigned node_size = 1;
+    unsigned index = offset + self->size - 1;
+
+    for (; self->longest[index]; index = parent(index)) {
+        node_size <<= 1;
+
+        if (index == 0) {
+            break;
+        }
+    }
+
+    /* offset points inside a block, not at its start */
+    if (self->longest[index] || (offset & (node_size - 1))) {
+        return 0;
+    }
+    return node_size;
+}
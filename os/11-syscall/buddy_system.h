@@ -0,0 +1,51 @@
+#ifndef _BUDDY_SYSTEM_H_
+#define _BUDDY_SYSTEM_H_
+
+// #include <stdio.h>
+// #include <stdlib.h>
+
+#include "os.h"
+#include "types.h"
+
+#define KB (1 << 10)
+
+/*
+ * Each node of the tree keeps the size of the largest free block below
+ * it, encoded in one byte as log2(fragments) + 1, or 0 when there is no
+ * free fragment below it.
+ * The tree covers a power of 2 number of fragments (size). When fewer
+ * fragments are backed by memory (avail), the ones past the end are
+ * marked allocated for good.
+ */
+struct buddy {
+    uint32_t size;
+    uint32_t avail;     /* fragments backed by memory */
+    uint32_t used;      /* fragments allocated */
+    uint32_t peak;      /* max of used since buddy_new */
+    uint8_t longest[1];
+};
+
+/* bytes taken by a buddy structure managing num_of_fragments fragments */
+static inline uint32_t buddy_meta_size(unsigned num_of_fragments)
+{
+    unsigned size = 1;
+
+    while (size < num_of_fragments) {
+        size <<= 1;
+    }
+    return sizeof(struct buddy) + (2 * size - 2) * sizeof(uint8_t);
+}
+
+/* number of fragments in the largest free block */
+static inline uint32_t buddy_longest(struct buddy *self)
+{
+    return self->longest[0] ? 1 << (self->longest[0] - 1) : 0;
+}
+
+struct buddy *buddy_new(unsigned num_of_fragments, uint32_t heap_start);
+int buddy_alloc(struct buddy *self, uint32_t size);
+void buddy_free(struct buddy *self, int offset);
+void buddy_dump(struct buddy *self);
+int buddy_size(struct buddy *self, int offset);
+
+#endif /* _BUDDY_SYSTEM_H_ */
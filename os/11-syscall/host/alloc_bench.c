@@ -0,0 +1,393 @@
+/*
+ * Trace-driven benchmark and fuzzer for the page allocator, built for
+ * the host (see the Makefile in this directory).
+ *
+ * A trace is a list of operations on numbered slots:
+ *	a <slot> <size>		page_alloc(size) into slot
+ *	f <slot>		page_free the block held by slot
+ * It is either generated at random (-n, -s, -k, -d) or read from a file
+ * recorded earlier with -w, or written by hand (-r).
+ *
+ * Every allocated block is checked to lie inside the heap, to be aligned
+ * as its size class promises, and to not overlap another live block: it
+ * is filled with a pattern of its slot that is checked again when the
+ * block is freed. The checks run outside of the timed sections.
+ */
+
+#include "../os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the POSIX timer calls clash with the kernel timer API of os.h */
+#define timer_create posix_timer_create
+#define timer_delete posix_timer_delete
+#include <time.h>
+#undef timer_create
+#undef timer_delete
+
+extern uint32_t HEAP_START;
+extern uint32_t HEAP_SIZE;
+extern void host_heap_init(uint32_t size);
+
+struct op {
+    char kind;		/* 'a' or 'f' */
+    uint32_t slot;
+    uint32_t size;
+};
+
+struct slot {
+    unsigned char *p;
+    uint32_t size;
+};
+
+static struct op *ops;
+static uint32_t nr_ops;
+static struct slot *slots;
+static uint32_t nr_slots;
+
+static uint32_t *lat;		/* ns of each page_alloc/page_free */
+static uint32_t nr_lat;
+
+static uint32_t seed = 1;
+
+static uint32_t _rand()
+{
+    /* xorshift32, so that traces do not depend on the libc */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint32_t _now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+/*
+ * Size distributions of the random traces
+ * - small: 16B to 256B, kmalloc sized requests hitting the 256B cache
+ * - page: 4K, the 4K cache
+ * - large: 256B to 64K in 256B steps
+ * - mixed: log2 uniform from 16B to 64K, most requests are small
+ */
+static uint32_t _size(const char *dist)
+{
+    if (strcmp(dist, "small") == 0) {
+        return 16 + _rand() % 241;
+    } else if (strcmp(dist, "page") == 0) {
+        return 4096;
+    } else if (strcmp(dist, "large") == 0) {
+        return 256 * (1 + _rand() % 256);
+    } else if (strcmp(dist, "mixed") == 0) {
+        uint32_t order = 4 + _rand() % 13;
+        return (1 << order) + _rand() % (1 << order);
+    }
+    fprintf(stderr, "unknown distribution %s\n", dist);
+    exit(1);
+}
+
+/*
+ * Each step picks a random slot, frees it if it holds a block and
+ * allocates into it otherwise, which keeps about half of the slots live.
+ * All blocks still live at the end are freed.
+ */
+static void _gen(uint32_t n, const char *dist)
+{
+    char *live = calloc(nr_slots, 1);
+
+    ops = malloc((n + nr_slots) * sizeof(struct op));
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t s = _rand() % nr_slots;
+        ops[nr_ops].slot = s;
+        if (live[s]) {
+            ops[nr_ops].kind = 'f';
+            ops[nr_ops].size = 0;
+        } else {
+            ops[nr_ops].kind = 'a';
+            ops[nr_ops].size = _size(dist);
+        }
+        live[s] = !live[s];
+        nr_ops++;
+    }
+    for (uint32_t s = 0; s < nr_slots; s++) {
+        if (live[s]) {
+            ops[nr_ops].kind = 'f';
+            ops[nr_ops].slot = s;
+            ops[nr_ops].size = 0;
+            nr_ops++;
+        }
+    }
+    free(live);
+}
+
+static void _load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    uint32_t cap = 1024;
+    char kind;
+    uint32_t slot, size;
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    ops = malloc(cap * sizeof(struct op));
+    nr_slots = 0;
+    while (fscanf(f, " %c %u", &kind, &slot) == 2) {
+        size = 0;
+        if (kind == 'a' && fscanf(f, "%u", &size) != 1) {
+            break;
+        }
+        if (nr_ops == cap) {
+            cap <<= 1;
+            ops = realloc(ops, cap * sizeof(struct op));
+        }
+        ops[nr_ops].kind = kind;
+        ops[nr_ops].slot = slot;
+        ops[nr_ops].size = size;
+        nr_ops++;
+        if (slot >= nr_slots) {
+            nr_slots = slot + 1;
+        }
+    }
+    fclose(f);
+}
+
+static void _save(const char *path)
+{
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    for (uint32_t i = 0; i < nr_ops; i++) {
+        if (ops[i].kind == 'a') {
+            fprintf(f, "a %u %u\n", ops[i].slot, ops[i].size);
+        } else {
+            fprintf(f, "f %u\n", ops[i].slot);
+        }
+    }
+    fclose(f);
+}
+
+static void _fail(uint32_t i, const char *what)
+{
+    fprintf(stderr, "op %u (%c %u %u): %s\n", i, ops[i].kind, ops[i].slot, ops[i].size, what);
+    exit(1);
+}
+
+/* alignment page_alloc promises for a block of size bytes */
+static uint32_t _align_of(uint32_t size)
+{
+    if (size == 4096) {
+        return 4096;
+    }
+    return 256;
+}
+
+static void _check_alloc(uint32_t i, unsigned char *p, uint32_t size)
+{
+    uint32_t a = (uint32_t) (unsigned long) p;
+
+    if (a < HEAP_START || a + size > HEAP_START + HEAP_SIZE || a + size < a) {
+        _fail(i, "block outside of the heap");
+    }
+    if (a & (_align_of(size) - 1)) {
+        _fail(i, "misaligned block");
+    }
+    memset(p, (ops[i].slot * 31 + 7) & 0xff, size);
+}
+
+static void _check_free(uint32_t i, unsigned char *p, uint32_t size)
+{
+    unsigned char c = (ops[i].slot * 31 + 7) & 0xff;
+
+    for (uint32_t k = 0; k < size; k++) {
+        if (p[k] != c) {
+            _fail(i, "block overwritten while allocated");
+        }
+    }
+}
+
+static int _cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Fragmentation, sampled every 1024 operations
+ * - internal: share of the heap in use (less the page caches) which was
+ *   not requested, due to rounding up to pages or powers of 2
+ * - external: share of the free heap which is not part of the largest
+ *   free block. Both backends split the heap in halves (the two pools,
+ *   or the two children of the buddy root), so it is at least 50 as long
+ *   as any block is live; the smallest largest free block is printed too.
+ */
+struct frag {
+    uint32_t internal;
+    uint32_t external;
+    uint32_t largest_min;
+};
+
+static void _frag_sample(struct frag *f, uint32_t live)
+{
+    struct page_stats st;
+    uint32_t free, held, pct;
+
+    page_get_stats(&st);
+    free = st.total - st.used;
+    held = st.used - st.cached;
+    if (held && live <= held) {
+        pct = 100 - (uint32_t) ((unsigned long long) live * 100 / held);
+        if (pct > f->internal) {
+            f->internal = pct;
+        }
+    }
+    if (free) {
+        pct = 100 - (uint32_t) ((unsigned long long) st.largest_free * 100 / free);
+        if (pct > f->external) {
+            f->external = pct;
+        }
+    }
+    if (st.largest_free < f->largest_min) {
+        f->largest_min = st.largest_free;
+    }
+}
+
+static void _replay(int check)
+{
+    struct page_stats st;
+    struct frag frag = { 0, 0, ~0u };
+    uint32_t failures = 0, live = 0, live_peak = 0;
+
+    slots = calloc(nr_slots, sizeof(struct slot));
+    lat = malloc(nr_ops * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < nr_ops; i++) {
+        struct slot *s = &slots[ops[i].slot];
+        uint32_t t0, t1;
+
+        if (ops[i].kind == 'a') {
+            if (s->p) {
+                _fail(i, "slot already holds a block");
+            }
+            t0 = _now();
+            s->p = page_alloc(ops[i].size);
+            t1 = _now();
+            lat[nr_lat++] = t1 - t0;
+            if (!s->p) {
+                failures++;
+                continue;
+            }
+            s->size = ops[i].size;
+            live += s->size;
+            if (live > live_peak) {
+                live_peak = live;
+            }
+            if (check) {
+                _check_alloc(i, s->p, s->size);
+            }
+        } else {
+            if (!s->p) {
+                /* the allocation failed, or a hand-written trace */
+                continue;
+            }
+            if (check) {
+                _check_free(i, s->p, s->size);
+            }
+            t0 = _now();
+            page_free(s->p);
+            t1 = _now();
+            lat[nr_lat++] = t1 - t0;
+            live -= s->size;
+            s->p = NULL;
+        }
+
+        if ((i & 1023) == 0) {
+            _frag_sample(&frag, live);
+        }
+    }
+
+    unsigned long long total_ns = 0;
+    for (uint32_t k = 0; k < nr_lat; k++) {
+        total_ns += lat[k];
+    }
+    qsort(lat, nr_lat, sizeof(uint32_t), _cmp);
+    if (nr_lat == 0) {
+        lat[nr_lat++] = 0;
+    }
+
+    page_get_stats(&st);
+    printf("ops:        %u (%u failed allocations)\n", nr_lat, failures);
+    printf("throughput: %llu ops/s, %llu ns/op\n",
+           total_ns ? nr_lat * 1000000000ull / total_ns : 0, total_ns / (nr_lat ? nr_lat : 1));
+    printf("latency:    p50 %u ns, p99 %u ns, max %u ns\n",
+           lat[nr_lat / 2], lat[nr_lat - nr_lat / 100 - 1], lat[nr_lat - 1]);
+    printf("heap:       total %u, peak used %u, peak requested %u\n", st.total, st.peak, live_peak);
+    printf("frag (pct): internal worst %u, external worst %u, largest free min %u\n",
+           frag.internal, frag.external, frag.largest_min);
+    printf("at end:     used %u (cached %u), largest free %u\n",
+           st.used, st.cached, st.largest_free);
+}
+
+static void _usage()
+{
+    fprintf(stderr,
+            "usage: alloc_bench [-n ops] [-s seed] [-k slots] [-d small|page|large|mixed]\n"
+            "                   [-m heap MiB] [-r trace] [-w trace] [-x]\n"
+            "  -r trace  replay a recorded trace instead of a random one\n"
+            "  -w trace  record the trace being replayed\n"
+            "  -x        skip the block checks\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n = 1000000, heap_mib = 128;
+    const char *dist = "mixed", *rpath = NULL, *wpath = NULL;
+    int check = 1, c;
+
+    nr_slots = 1024;
+    while ((c = getopt(argc, argv, "n:s:k:d:m:r:w:x")) != -1) {
+        switch (c) {
+        case 'n': n = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'k': nr_slots = strtoul(optarg, NULL, 0); break;
+        case 'd': dist = optarg; break;
+        case 'm': heap_mib = strtoul(optarg, NULL, 0); break;
+        case 'r': rpath = optarg; break;
+        case 'w': wpath = optarg; break;
+        case 'x': check = 0; break;
+        default: _usage();
+        }
+    }
+    if (seed == 0 || nr_slots == 0 || heap_mib == 0 || heap_mib > 2047) {
+        _usage();
+    }
+
+    if (rpath) {
+        _load(rpath);
+    } else {
+        _gen(n, dist);
+    }
+    if (wpath) {
+        _save(wpath);
+    }
+    if (nr_ops == 0) {
+        _usage();
+    }
+
+    host_heap_init(heap_mib << 20);
+    page_init();
+    printf("\n");
+    _replay(check);
+    return 0;
+}
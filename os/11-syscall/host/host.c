@@ -0,0 +1,43 @@
+#include "../os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/*
+ * Host stand-ins for what the allocators expect from the rest of the
+ * kernel: the layout symbols of mem.S and panic().
+ */
+uint32_t TEXT_START;
+uint32_t TEXT_END;
+uint32_t DATA_START;
+uint32_t DATA_END;
+uint32_t RODATA_START;
+uint32_t RODATA_END;
+uint32_t BSS_START;
+uint32_t BSS_END;
+uint32_t HEAP_START;
+uint32_t HEAP_SIZE;
+
+void panic(char *s)
+{
+    fprintf(stderr, "panic: %s\n", s);
+    exit(1);
+}
+
+/*
+ * Map an arena of size bytes to play the heap. The allocators keep
+ * addresses in uint32_t, so the arena has to sit below 4 GiB:
+ * MAP_32BIT puts it in the low 2 GiB on x86-64. It is populated up
+ * front so that page faults do not show up as allocator latency.
+ */
+void host_heap_init(uint32_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) {
+        panic("host_heap_init: mmap failed");
+    }
+    HEAP_START = (uint32_t) (unsigned long) p;
+    HEAP_SIZE = size;
+}
@@ -3,10 +3,17 @@
 extern void uart_init(void);
 extern void uart_puts(char *s);
 extern void sched_init(void);
+extern void sched_init_hart(void);
 extern void schedule(void);
 extern void os_main(void);
 extern void plic_init(void);
 extern void timer_init(void);
+extern void timer_init_hart(void);
+extern void kmalloc_init(void);
+extern void kmalloc_bench(void);
+
+/* set by hart 0 once the kernel is up, the other harts wait for it */
+static volatile int _kernel_ready = 0;
 
 void start_kernel(void)
 {
@@ -16,6 +23,16 @@ void start_kernel(void)
     page_init();
     // page_test();
 
+    kmalloc_init();
+
+    /* fill the pre-zeroed pool before the idle loop takes over */
+    while (page_zero_refill());
+
+#ifdef CONFIG_MEM_BENCH
+    kmalloc_bench();
+    page_stats_dump();
+#endif
+
     trap_init();
 
     plic_init();
@@ -26,7 +43,30 @@ void start_kernel(void)
     
     os_main();
 
+    /* the tasks made so far are on hart 0, idle harts steal them */
+    __sync_synchronize();
+    _kernel_ready = 1;
+
     schedule();
     
     while (1) {}; // loop here
+}
+
+/* harts other than 0 come here from start.S */
+void start_hart(void)
+{
+    while (!_kernel_ready) {}
+    __sync_synchronize();
+
+    trap_init();
+
+    plic_init();
+
+    timer_init_hart();
+
+    sched_init_hart();
+
+    schedule();
+
+    while (1) {};
 }
\ No newline at end of file
@@ -10,4 +10,23 @@ int spin_unlock()
 {
     w_mstatus(r_mstatus() | MSTATUS_MIE);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Spinlocks shared between harts.
+ * amoswap-based like acquire_mutex in mutex.S; they do not touch the
+ * interrupt enable bit, so use them where interrupts are already off.
+ */
+void spinlock_acquire(struct spinlock *lk)
+{
+    while (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+        ;
+    }
+    __sync_synchronize();
+}
+
+void spinlock_release(struct spinlock *lk)
+{
+    __sync_synchronize();
+    __sync_lock_release(&lk->locked);
+}
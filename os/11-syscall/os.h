@@ -8,6 +8,24 @@
 #include <stddef.h>
 #include <stdarg.h>
 
+/* index of the least significant set bit, x must not be 0 */
+static inline int ffs32(uint32_t x)
+{
+    int n = 0;
+    if (!(x & 0xffff)) { n += 16; x >>= 16; }
+    if (!(x & 0xff))   { n += 8;  x >>= 8; }
+    if (!(x & 0xf))    { n += 4;  x >>= 4; }
+    if (!(x & 0x3))    { n += 2;  x >>= 2; }
+    if (!(x & 0x1))    { n += 1; }
+    return n;
+}
+
+/* lower 32 bits of mtime, which counts at CLINT_TIMEBASE_FREQ */
+static inline uint32_t r_mtime()
+{
+    return *(volatile uint32_t *) CLINT_MTIME;
+}
+
 /* uart */
 extern int uart_putc(char ch);
 extern void uart_puts(char *s);
@@ -16,12 +34,63 @@ extern void uart_puts(char *s);
 extern int  printf(const char* s, ...);
 extern void panic(char *s);
 
+/* lock */
+extern int spin_lock(void);
+extern int spin_unlock(void);
+
+struct spinlock {
+	volatile uint32_t locked;
+};
+extern void spinlock_acquire(struct spinlock *lk);
+extern void spinlock_release(struct spinlock *lk);
+
 /* memory management */
-extern void *page_alloc(int npages, uint32_t n_pages_type);
-extern void page_free(void *p, uint32_t n_pages_type);
+extern void *page_alloc(uint32_t size);
+extern void *page_alloc_zeroed(uint32_t size);
+extern void page_free(void *p);
+extern int page_zero_refill();
 extern void page_init();
 extern void trap_init();
 
+/* page allocator statistics, sizes are in bytes */
+#define PAGE_LAT_BUCKETS 16
+struct page_stats {
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t failures;
+	uint32_t total;		/* size of the heap */
+	uint32_t used;		/* allocated from the heap, including cached and zeroed */
+	uint32_t cached;	/* held in the per-hart page caches */
+	uint32_t zeroed;	/* held cleared for page_alloc_zeroed */
+	uint32_t peak;		/* max of used */
+	uint32_t largest_free;	/* largest block page_alloc can still return */
+	uint32_t latency[PAGE_LAT_BUCKETS]; /* page_alloc calls per log2(cycles) */
+};
+extern void page_get_stats(struct page_stats *st);
+extern void page_stats_dump();
+
+/* slab allocator */
+struct slab;
+struct kmem_cache {
+	const char *name;
+	uint32_t size;		/* object size, including the link word */
+	uint32_t offset;	/* offset of the free list link in an object */
+	uint32_t flags;
+	uint32_t slab_size;	/* 256B or 4K page */
+	uint32_t objs_per_slab;
+	void (*ctor)(void *obj);
+	struct slab *partial;
+	struct slab *full;
+	struct slab *empty;
+	struct spinlock lock;
+};
+extern struct kmem_cache *kmem_cache_create(const char *name, uint32_t size,
+					    void (*ctor)(void *obj));
+extern void *kmem_cache_alloc(struct kmem_cache *cache);
+extern void kmem_cache_free(struct kmem_cache *cache, void *obj);
+extern void *kmalloc(uint32_t size);
+extern void kfree(void *p);
+
 /* task management */
 struct context {
 	/* ignore x0 */
@@ -59,7 +128,33 @@ struct context {
 	reg_t pc; // save the program counter to run in next schedule cycle, offset 31 * 4 = 124
 };
 
-extern int  task_create(void (*task)(void));
+/* per-task CPU accounting, times are in ms of mtime */
+struct task_stats {
+	uint32_t run_ms;	/* time the task ran for, traps included */
+	uint32_t trap_ms;	/* time spent in traps taken while it ran */
+	uint32_t switches;	/* times it was switched to */
+	uint32_t voluntary;	/* switched out as it blocked, yielded or exited */
+	uint32_t involuntary;	/* switched out as it was preempted or killed */
+};
+
+extern int  task_create(void (*task)(void), uint8_t priority, uint32_t stack_size);
+extern void task_exit();
+extern int  task_kill(int id);
+extern void task_sleep(uint32_t ticks);
+extern void task_sleep_until(uint32_t tick);
+extern void task_wake_sleepers(uint32_t tick);
+extern int task_next_wake(uint32_t *tick);
+extern int task_set_slice(int id, uint32_t ticks);
+extern int task_create_periodic(void (*job)(void), uint32_t period, uint32_t budget, uint32_t deadline);
+extern void task_wait_period(void);
+extern int task_deadline_misses(int id);
+extern int task_get_stats(int id, struct task_stats *st);
+extern void sched_trap_enter(void);
+extern void sched_trap_exit(void);
+extern void sched_tick(uint32_t tick);
+extern void sched_util_report(uint32_t tick);
+extern int  task_stack_usage(int id);
+extern void task_stack_check();
 extern void task_delay(volatile int count);
 extern void task_yield();
 
@@ -67,18 +162,27 @@ extern void task_yield();
 extern int plic_claim(void);
 extern void plic_complete(int irq);
 
-/* lock */
-extern int spin_lock(void);
-extern int spin_unlock(void);
 
+/* tick frequency, set with HZ in the Makefile */
+#ifndef CONFIG_HZ
+#define CONFIG_HZ 100
+#endif
+#if CONFIG_HZ < 100 || CONFIG_HZ > 10000
+#error "HZ must be between 100 and 10000"
+#endif
+#define HZ CONFIG_HZ
 
 /* software timer */
 struct timer {
 	void (*func) (void *arg);
 	void *arg;
 	uint32_t timeout_tick;
+	struct timer *next;
 };
 extern struct timer *timer_create(void (*handler) (void *arg), void *arg, uint32_t timeout);
 extern void timer_delete(struct timer *timer);
+extern uint32_t timer_get_tick();
+extern uint32_t timer_slice_start(uint32_t ticks);
+extern void timer_wake_changed(void);
 
 #endif /* __OS_H_ */
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "os.h"
 
+#ifdef CONFIG_BUDDY
+#include "buddy_system.h"
+#endif
+
 /*
  * Following global vars are defined in mem.S
  */
@@ -14,218 +18,1053 @@ extern uint32_t BSS_END;
 extern uint32_t HEAP_START;
 extern uint32_t HEAP_SIZE;
 
-static uint32_t heap_4k_start;
-static uint32_t heap_256b_start;
-
-/*
- * _alloc_start points to the actual start address of heap pool
- * _alloc_end points to the actual end address of heap pool
- * _num_pages holds the actual max number of pages we can allocate.
- */
-static uint32_t _alloc_start_256b = 0;
-static uint32_t _alloc_end_256b = 0;
-static uint32_t _num_pages_256b = 0;
-static uint32_t _alloc_start_4k = 0;
-static uint32_t _alloc_end_4k = 0;
-static uint32_t _num_pages_4k = 0;
-
 #define PAGE_SIZE_256B 256
 #define PAGE_ORDER_256B 8
 
 #define PAGE_SIZE_4K 4096
 #define PAGE_ORDER_4K 12
 
-#define PAGE_TAKEN  (uint8_t)(1 << 0)
-#define PAGE_LAST   (uint8_t)(1 << 1)
+/* classes of blocks kept in the per-hart page caches */
+#define PAGE_CLASS_256B 0
+#define PAGE_CLASS_4K 1
+#define NR_PAGE_CLASSES 2
+
+static inline uint32_t _align_page(uint32_t address, uint8_t page_order)
+{
+    uint32_t order = (1 << page_order) - 1;
+    return (address + order) & ~(order);
+}
+
+#ifndef CONFIG_BUDDY
 
 /*
- * Page Descriptor 
- * flags:
- * - bit 0: flag if this page is taken(allocated)
- * - bit 1: flag if this page is the last page of the memory block allocated
+ * Page Descriptors
+ * The state of the pages is packed in two bitmaps, one bit per page, so
+ * that a 32-bit load covers 32 pages:
+ * - taken: flag if this page is taken(allocated)
+ * - last: flag if this page is the last page of the memory block allocated
  */
-struct Page {
-    uint8_t flags;
+#define BITS_PER_WORD 32
+#define BITS_TO_WORDS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+/*
+ * Free run header
+ * A run is a maximal block of contiguous free pages. The header lives in
+ * the first page of the run itself, so the free lists cost no extra memory.
+ * The last page of a run keeps a pointer back to the header in its last
+ * word (see _run_tail), which lets page_free find the left neighbour in O(1).
+ */
+struct run {
+    struct run *next;
+    struct run *prev;
+    uint32_t npages;
+};
+
+/*
+ * Runs are segregated by size: free_list[k] holds the runs whose length
+ * is in [2^k, 2^(k+1)), and bit k of bitmap is set if free_list[k] is
+ * not empty.
+ */
+#define NR_RUN_CLASSES 32
+
+/*
+ * Page pool
+ * - taken, last: page descriptor bitmaps of this pool
+ * - alloc_start: the actual start address of the pool
+ * - alloc_end: the actual end address of the pool
+ * - num_pages: the actual max number of pages we can allocate
+ */
+struct pool {
+    uint32_t *taken;
+    uint32_t *last;
+    uint32_t alloc_start;
+    uint32_t alloc_end;
+    uint32_t num_pages;
+    uint8_t page_order;
+    uint32_t bitmap;
+    struct run *free_list[NR_RUN_CLASSES];
 };
 
-static inline void _clear(struct Page *page)
+static struct pool pool_256b;
+static struct pool pool_4k;
+
+/*
+ * Both pools span the whole heap, and every 4K frame belongs to the 4K
+ * pool. The 256B pool only uses the frames it borrowed from it, flagged
+ * in lent (one bit per frame); its pages in the other frames are marked
+ * taken, so that they are neither handed out nor merged with.
+ * - a 256B pool allocation that does not fit borrows the frames it lacks
+ * - a 4K pool allocation that does not fit first takes back every frame
+ *   the 256B pool has left entirely free
+ * At boot, the first half of the frames is lent to the 256B pool.
+ */
+#define PAGES_PER_FRAME (PAGE_SIZE_4K / PAGE_SIZE_256B)
+
+static uint32_t *lent;
+static uint32_t _nr_lent = 0;
+
+/* bytes handed out by the pools, now and at most */
+static uint32_t _used = 0;
+static uint32_t _peak = 0;
+
+/* floor(log2(x)), x must not be 0 */
+static inline int _fls(uint32_t x)
 {
-    page->flags = 0;
+    int n = 0;
+    if (x & 0xffff0000) { n += 16; x >>= 16; }
+    if (x & 0xff00)     { n += 8;  x >>= 8; }
+    if (x & 0xf0)       { n += 4;  x >>= 4; }
+    if (x & 0xc)        { n += 2;  x >>= 2; }
+    if (x & 0x2)        { n += 1; }
+    return n;
 }
 
-static inline int _is_free(struct Page *page)
+static inline int _test_bit(uint32_t *map, uint32_t i)
 {
-    return !(page->flags & PAGE_TAKEN);
+    return map[i / BITS_PER_WORD] & (1U << (i % BITS_PER_WORD));
 }
 
-static inline void _set_flag(struct Page *page, uint8_t flags)
+static inline int _is_free(struct pool *pool, uint32_t i)
 {
-    page->flags |= flags;
+    return !_test_bit(pool->taken, i);
 }
 
-static inline int _is_last(struct Page *page)
+/* mask of the bits [i, i + n) that fall in the word holding bit i */
+static inline uint32_t _word_mask(uint32_t i, uint32_t n)
 {
-    return (page->flags & PAGE_LAST);
+    uint32_t lo = i % BITS_PER_WORD;
+    uint32_t mask = ~0U << lo;
+    if (lo + n < BITS_PER_WORD) {
+        mask &= ~(~0U << (lo + n));
+    }
+    return mask;
 }
 
-static inline uint32_t _align_page(uint32_t address, uint8_t page_order)
+/* set (value = 1) or clear (value = 0) bits [i, i + n), a word at a time */
+static void _fill_bits(uint32_t *map, uint32_t i, uint32_t n, int value)
 {
-    uint32_t order = (1 << page_order) - 1;
-    return (address + order) & ~(order);
+    while (n) {
+        uint32_t mask = _word_mask(i, n);
+        uint32_t count = BITS_PER_WORD - i % BITS_PER_WORD;
+        if (value) {
+            map[i / BITS_PER_WORD] |= mask;
+        } else {
+            map[i / BITS_PER_WORD] &= ~mask;
+        }
+        if (count > n) {
+            count = n;
+        }
+        i += count;
+        n -= count;
+    }
 }
 
-void page_init()
+/*
+ * index of the first set bit at or after i, or end if there is none;
+ * words without any set bit are skipped with a single test
+ */
+static uint32_t _next_bit(uint32_t *map, uint32_t i, uint32_t end)
 {
-    printf("HEAP_START: 0x%x, HEAP_SIZE: 0x%x\n", HEAP_START, HEAP_SIZE);
-    
-    /* 
-	 * We reserved 120 Page (120 x 256) to hold the Page structures.
-	 */
-    uint32_t first_heap_size = HEAP_SIZE / 2;
-    _num_pages_256b = (first_heap_size / PAGE_SIZE_256B) - 120;
-    heap_256b_start = HEAP_START;
-    struct Page *page = (struct Page *) (HEAP_START);
-    for (int i = 0; i < _num_pages_256b; i++) {
-        _clear(page++);
-    }
-    _alloc_start_256b =_align_page(HEAP_START + 120 * PAGE_SIZE_256B, PAGE_ORDER_256B);
-    _alloc_end_256b = _alloc_start_256b + (PAGE_SIZE_256B * _num_pages_256b);
-    
-
-    /* 
-	 * We reserved 8 Page (8 x 4096) to hold the Page structures.
-	 */
-    uint32_t sec_heap_size = HEAP_SIZE - first_heap_size;
-    _num_pages_4k = (sec_heap_size / PAGE_SIZE_4K) - 8;
-    heap_4k_start = (HEAP_START + first_heap_size);
-    page = (struct Page *) (HEAP_START + first_heap_size);
-    for (int i = 0; i < _num_pages_4k; i++) {
-        _clear(page++);
+    uint32_t w = i / BITS_PER_WORD;
+    uint32_t word = map[w] & (~0U << (i % BITS_PER_WORD));
+
+    while (!word) {
+        if (++w >= BITS_TO_WORDS(end)) {
+            return end;
+        }
+        word = map[w];
     }
-    _alloc_start_4k = _align_page((HEAP_START + first_heap_size) + 8 * PAGE_SIZE_4K, PAGE_ORDER_4K);
-    _alloc_end_4k = _alloc_start_4k + (PAGE_SIZE_4K * _num_pages_4k);
-    
+    i = w * BITS_PER_WORD + ffs32(word);
+    return (i < end) ? i : end;
+}
 
-    printf("TEXT:   0x%x -> 0x%x\n", TEXT_START, TEXT_END);
-	printf("RODATA: 0x%x -> 0x%x\n", RODATA_START, RODATA_END);
-	printf("DATA:   0x%x -> 0x%x\n", DATA_START, DATA_END);
-	printf("BSS:    0x%x -> 0x%x\n", BSS_START, BSS_END);
-	printf("HEAP:\n");
-    printf("\t_alloc_start_256b = %x, _alloc_end_256b = %x, num of pages = %d\n", _alloc_start_256b, _alloc_end_256b, _num_pages_256b);
-    printf("\t_alloc_start_4k = %x, _alloc_end_4k = %x, num of pages = %d\n", _alloc_start_4k, _alloc_end_4k, _num_pages_4k);
+static inline struct run *_page_addr(struct pool *pool, uint32_t i)
+{
+    return (struct run *) (pool->alloc_start + (i << pool->page_order));
+}
+
+static inline uint32_t _page_index(struct pool *pool, void *p)
+{
+    return ((uint32_t) p - pool->alloc_start) >> pool->page_order;
+}
+
+static inline struct run **_run_tail(struct pool *pool, struct run *r)
+{
+    uint32_t last = (uint32_t) r + (r->npages << pool->page_order);
+    return (struct run **) (last - sizeof(struct run *));
+}
+
+static void _run_insert(struct pool *pool, uint32_t i, uint32_t npages)
+{
+    struct run *r = _page_addr(pool, i);
+    int k = _fls(npages);
+
+    r->npages = npages;
+    r->prev = NULL;
+    r->next = pool->free_list[k];
+    if (r->next) {
+        r->next->prev = r;
+    }
+    pool->free_list[k] = r;
+    pool->bitmap |= (1U << k);
+
+    *_run_tail(pool, r) = r;
+}
+
+static void _run_remove(struct pool *pool, struct run *r)
+{
+    int k = _fls(r->npages);
+
+    if (r->prev) {
+        r->prev->next = r->next;
+    } else {
+        pool->free_list[k] = r->next;
+    }
+    if (r->next) {
+        r->next->prev = r->prev;
+    }
+    if (!pool->free_list[k]) {
+        pool->bitmap &= ~(1U << k);
+    }
 }
 
 /*
- * Allocate a memory block which is composed of contiguous physical pages
- * - npages: the number of PAGE_SIZE pages to allocate
+ * Find a free run holding at least npages pages.
+ * Every run in a class above log2(npages) rounded up is large enough, so
+ * the bitmap answers in O(1). Only when all of those are empty do we walk
+ * the class npages itself falls in, where runs may or may not fit.
  */
-void *page_alloc(int npages, uint32_t n_pages_type)
+static struct run *_run_find(struct pool *pool, uint32_t npages)
 {
-    int found = 0;
-    struct Page *page_i = (struct Page *)HEAP_START;
-    if (n_pages_type == _num_pages_4k) {
-        page_i = (struct Page *) heap_4k_start;
-    } else {
-        page_i = (struct Page *) heap_256b_start;
-    }
-
-    for (int i = 0; i <= (n_pages_type - npages); i++) {
-        if (_is_free(page_i)) {
-            found = 1;
-            /* 
-			 * meet a free page, continue to check if following
-			 * (npages - 1) pages are also unallocated.
-			 */
-            struct Page *page_j = page_i + 1;
-            for (int j = i + 1; j < (i + npages); j++) {
-                if (!_is_free(page_j)) {
-                    found = 0;
-                    break;
-                }
-                page_j++;
+    int k = _fls(npages);
+    int fit = (npages == (1U << k)) ? k : k + 1;
+
+    if (fit < NR_RUN_CLASSES) {
+        uint32_t mask = pool->bitmap & ~((1U << fit) - 1);
+        if (mask) {
+            return pool->free_list[ffs32(mask)];
+        }
+    }
+
+    for (struct run *r = pool->free_list[k]; r; r = r->next) {
+        if (r->npages >= npages) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Set up a pool of num_pages page_order sized pages from start on, with
+ * its page descriptors at desc. All the pages start out taken, they are
+ * handed over to the pool with _pool_give.
+ * Return the end of the descriptors.
+ */
+static uint32_t *_pool_init(struct pool *pool, uint32_t *desc, uint32_t start,
+                            uint32_t num_pages, uint8_t page_order)
+{
+    uint32_t words = BITS_TO_WORDS(num_pages);
+
+    pool->page_order = page_order;
+    pool->alloc_start = start;
+    pool->num_pages = num_pages;
+    pool->alloc_end = start + (num_pages << page_order);
+
+    pool->taken = desc;
+    pool->last = desc + words;
+    for (int i = 0; i < words; i++) {
+        pool->taken[i] = ~0U;
+        pool->last[i] = 0;
+    }
+
+    pool->bitmap = 0;
+    for (int k = 0; k < NR_RUN_CLASSES; k++) {
+        pool->free_list[k] = NULL;
+    }
+    return pool->last + words;
+}
+
+/*
+ * Take npages contiguous pages out of the free runs of a pool, or return
+ * NULL if no run is large enough.
+ */
+static struct run *_pool_alloc(struct pool *pool, uint32_t npages)
+{
+    if (npages == 0 || npages > pool->num_pages) {
+        return NULL;
+    }
+
+    struct run *r = _run_find(pool, npages);
+    if (!r) {
+        return NULL;
+    }
+
+    /* take the head of the run, give the rest back to the free lists */
+    uint32_t i = _page_index(pool, r);
+    uint32_t left = r->npages - npages;
+    _run_remove(pool, r);
+    if (left) {
+        _run_insert(pool, i + npages, left);
+    }
+
+    _fill_bits(pool->taken, i, npages, 1);
+    _fill_bits(pool->last, i + npages - 1, 1, 1);
+    return r;
+}
+
+/*
+ * Free the block starting at page i of a pool, return its number of
+ * pages, or 0 if no block starts there.
+ */
+static uint32_t _pool_free(struct pool *pool, uint32_t i)
+{
+    if (_is_free(pool, i)) {
+        return 0;
+    }
+
+    /* the block ends at the next page flagged as last */
+    uint32_t last = _next_bit(pool->last, i, pool->num_pages);
+    if (last == pool->num_pages) {
+        return 0;
+    }
+    uint32_t npages = last - i + 1;
+    uint32_t freed = npages;
+    _fill_bits(pool->taken, i, npages, 0);
+    _fill_bits(pool->last, last, 1, 0);
+
+    /* merge with the free runs right before and right after the block */
+    if (i > 0 && _is_free(pool, i - 1)) {
+        struct run **tail = (struct run **) ((uint32_t) _page_addr(pool, i) - sizeof(struct run *));
+        struct run *r = *tail;
+        _run_remove(pool, r);
+        i = _page_index(pool, r);
+        npages += r->npages;
+    }
+    if (i + npages < pool->num_pages && _is_free(pool, i + npages)) {
+        struct run *r = _page_addr(pool, i + npages);
+        _run_remove(pool, r);
+        npages += r->npages;
+    }
+    _run_insert(pool, i, npages);
+    return freed;
+}
+
+/* hand the taken pages [i, i + npages) over to the free runs of a pool */
+static void _pool_give(struct pool *pool, uint32_t i, uint32_t npages)
+{
+    _fill_bits(pool->last, i + npages - 1, 1, 1);
+    _pool_free(pool, i);
+}
+
+/*
+ * Lend the 256B pool enough frames to hold npages of its pages.
+ * Each frame is a block of its own in the 4K pool, so that it can be
+ * taken back alone. Return 0 if the 4K pool has no such free run.
+ */
+static int _frames_lend(uint32_t npages)
+{
+    uint32_t nframes = (npages + PAGES_PER_FRAME - 1) / PAGES_PER_FRAME;
+    struct run *r = _pool_alloc(&pool_4k, nframes);
+
+    if (!r) {
+        return 0;
+    }
+    uint32_t f = _page_index(&pool_4k, r);
+    _fill_bits(pool_4k.last, f, nframes, 1);
+    _fill_bits(lent, f, nframes, 1);
+    _nr_lent += nframes;
+
+    _pool_give(&pool_256b, f * PAGES_PER_FRAME, nframes * PAGES_PER_FRAME);
+    return 1;
+}
+
+/*
+ * Take back every frame the 256B pool has entirely free, return the
+ * number of frames taken back.
+ * Only runs of a frame or more can cover a whole frame. What is left of
+ * a run around its whole frames is shorter than a frame, so it goes back
+ * to a class below the ones being walked.
+ */
+static uint32_t _frames_reclaim()
+{
+    uint32_t count = 0;
+
+    for (int k = _fls(PAGES_PER_FRAME); k < NR_RUN_CLASSES; k++) {
+        struct run *next;
+        for (struct run *r = pool_256b.free_list[k]; r; r = next) {
+            next = r->next;
+
+            uint32_t i = _page_index(&pool_256b, r);
+            uint32_t end = i + r->npages;
+            uint32_t first = (i + PAGES_PER_FRAME - 1) & ~(PAGES_PER_FRAME - 1);
+            uint32_t stop = end & ~(PAGES_PER_FRAME - 1);
+            if (first >= stop) {
+                continue;
+            }
+
+            _run_remove(&pool_256b, r);
+            if (first > i) {
+                _run_insert(&pool_256b, i, first - i);
             }
-            /*
-			 * get a memory block which is good enough for us,
-			 * take housekeeping, then return the actual start
-			 * address of the first page of this memory block
-			 */
-            if (found) {
-                struct Page *page_k = page_i;
-                for (int k = i; k < (i + npages); k++) {
-                    _set_flag(page_k, PAGE_TAKEN);
-                    page_k++;
-                }
-                page_k--;
-                _set_flag(page_k, PAGE_LAST);
-
-                if (n_pages_type == _num_pages_4k) {
-                    return (void *) (_alloc_start_4k + i * PAGE_SIZE_4K);
-                } else {
-                    return (void *) (_alloc_start_256b + i * PAGE_SIZE_256B);
-                }
-                
+            if (end > stop) {
+                _run_insert(&pool_256b, stop, end - stop);
+            }
+            _fill_bits(pool_256b.taken, first, stop - first, 1);
+
+            for (uint32_t f = first / PAGES_PER_FRAME; f < stop / PAGES_PER_FRAME; f++) {
+                _fill_bits(lent, f, 1, 0);
+                _pool_free(&pool_4k, f);
+                count++;
             }
         }
-        page_i++;
     }
-    return NULL;
+    _nr_lent -= count;
+    return count;
+}
+
+/* bytes of descriptors for nframes frames: lent, then both pools */
+static inline uint32_t _desc_size(uint32_t nframes)
+{
+    return (BITS_TO_WORDS(nframes) * 3 +
+            BITS_TO_WORDS(nframes * PAGES_PER_FRAME) * 2) * sizeof(uint32_t);
+}
+
+static void _heap_init()
+{
+    /*
+	 * The descriptors sit at the beginning of the heap, sized for the
+	 * frames that fit after them, leaving room to align the first frame.
+	 * The first guess leaves room for the descriptors of the whole heap.
+	 */
+    uint32_t nframes = (HEAP_SIZE - PAGE_SIZE_4K) >> PAGE_ORDER_4K;
+    nframes = (HEAP_SIZE - PAGE_SIZE_4K - _desc_size(nframes)) >> PAGE_ORDER_4K;
+    while (_desc_size(nframes + 1) + PAGE_SIZE_4K +
+           ((nframes + 1) << PAGE_ORDER_4K) <= HEAP_SIZE) {
+        nframes++;
+    }
+    uint32_t start = _align_page(HEAP_START + _desc_size(nframes), PAGE_ORDER_4K);
+
+    uint32_t *desc = (uint32_t *) HEAP_START;
+    lent = desc;
+    for (int i = 0; i < BITS_TO_WORDS(nframes); i++) {
+        lent[i] = 0;
+    }
+    desc = _pool_init(&pool_4k, lent + BITS_TO_WORDS(nframes), start,
+                      nframes, PAGE_ORDER_4K);
+    _pool_init(&pool_256b, desc, start, nframes * PAGES_PER_FRAME, PAGE_ORDER_256B);
+
+    _pool_give(&pool_4k, 0, nframes);
+    _frames_lend(nframes / 2 * PAGES_PER_FRAME);
+}
+
+static void _heap_dump()
+{
+    printf("\t_alloc_start = %x, _alloc_end = %x, num of 4K frames = %d, lent to the 256B pool = %d\n",
+           pool_4k.alloc_start, pool_4k.alloc_end, pool_4k.num_pages, _nr_lent);
+}
+
+/*
+ * Requests smaller than a 4K page are served from the 256B pool, larger
+ * ones from the 4K pool. A block is given back to the pool that owns its
+ * frame; p must lie in the heap.
+ */
+static inline struct pool *_pool_of(void *p)
+{
+    uint32_t f = ((uint32_t) p - pool_4k.alloc_start) >> PAGE_ORDER_4K;
+    return _test_bit(lent, f) ? &pool_256b : &pool_4k;
+}
+
+static inline int _in_heap(void *p)
+{
+    return (uint32_t) p >= pool_4k.alloc_start && (uint32_t) p < pool_4k.alloc_end;
+}
+
+/*
+ * Allocate a memory block which is composed of contiguous physical pages
+ * - size: the number of bytes to allocate
+ */
+static void *_heap_alloc(uint32_t size)
+{
+    struct pool *pool = (size < PAGE_SIZE_4K) ? &pool_256b : &pool_4k;
+    uint32_t npages = (size + (1 << pool->page_order) - 1) >> pool->page_order;
+
+    struct run *r = _pool_alloc(pool, npages);
+    if (!r) {
+        /* move frames from the other pool, then try again */
+        int moved = (pool == &pool_256b) ? _frames_lend(npages) : _frames_reclaim();
+        if (moved) {
+            r = _pool_alloc(pool, npages);
+        }
+        if (!r) {
+            return NULL;
+        }
+    }
+
+    _used += npages << pool->page_order;
+    if (_used > _peak) {
+        _peak = _used;
+    }
+
+    return (void *) r;
 }
 
 /*
  * Free the memory block
  * - p: start address of the memory block
  */
-void page_free(void *p, uint32_t n_pages_type)
+static void _heap_free(void *p)
 {
     /*
 	 * Assert (TBD) if p is invalid
 	 */
-    if (!p || (uint32_t)p >= _alloc_end_4k) {
+    if (!p || !_in_heap(p)) {
         return;
     }
-    /* get the first page descriptor of this memory block */
-    struct Page *page;
-    if (n_pages_type == _num_pages_4k) {
-        page = (struct Page *) heap_4k_start;
-        page += ((uint32_t)p - _alloc_start_4k) / PAGE_SIZE_4K;
-    } else {
-        page = (struct Page *) heap_256b_start;
-        page += ((uint32_t)p - _alloc_start_256b) / PAGE_SIZE_256B;
-    }
-    
-    /* loop and clear all the page descriptors of the memory block */
-    while (!_is_free(page)) {
-        if (_is_last(page)) {
-            _clear(page);
+    struct pool *pool = _pool_of(p);
+    uint32_t npages = _pool_free(pool, _page_index(pool, p));
+    _used -= npages << pool->page_order;
+}
+
+/*
+ * Per-hart caches hold single pages of either pool: a 256B page for
+ * requests up to 256 bytes, a 4K page for requests of exactly 4K.
+ */
+static inline int _size_class(uint32_t size)
+{
+    if (size <= PAGE_SIZE_256B) {
+        return PAGE_CLASS_256B;
+    }
+    if (size == PAGE_SIZE_4K) {
+        return PAGE_CLASS_4K;
+    }
+    return -1;
+}
+
+/*
+ * Cache class of an allocated block, or -1 if it is not a single page.
+ * Only reads the descriptor bits of this block, which nobody else changes
+ * while we own it, so no lock is needed.
+ */
+static inline int _block_class(void *p)
+{
+    if (!_in_heap(p)) {
+        return -1;
+    }
+    struct pool *pool = _pool_of(p);
+    uint32_t i = _page_index(pool, p);
+    if (_is_free(pool, i) || !_test_bit(pool->last, i)) {
+        return -1;
+    }
+    return (pool == &pool_4k) ? PAGE_CLASS_4K : PAGE_CLASS_256B;
+}
+
+/* size in bytes of the largest free run of a pool */
+static uint32_t _largest_run(struct pool *pool)
+{
+    uint32_t largest = 0;
+
+    if (pool->bitmap) {
+        for (struct run *r = pool->free_list[_fls(pool->bitmap)]; r; r = r->next) {
+            if (r->npages > largest) {
+                largest = r->npages;
+            }
+        }
+    }
+    return largest << pool->page_order;
+}
+
+static void _heap_stats(struct page_stats *st)
+{
+    uint32_t largest_256b = _largest_run(&pool_256b);
+    uint32_t largest_4k = _largest_run(&pool_4k);
+
+    st->total = pool_4k.num_pages << PAGE_ORDER_4K;
+    st->used = _used;
+    st->peak = _peak;
+    st->largest_free = (largest_256b > largest_4k) ? largest_256b : largest_4k;
+}
+
+#else /* CONFIG_BUDDY */
+
+/*
+ * The whole heap is managed by one buddy tree whose fragments are 256B
+ * pages. The tree itself sits at the beginning of the heap, the pages
+ * follow it.
+ * - _alloc_start points to the actual start address of heap pool
+ * - _alloc_end points to the actual end address of heap pool
+ */
+static struct buddy *buddy_sys = NULL;
+static uint32_t _alloc_start = 0;
+static uint32_t _alloc_end = 0;
+
+static void _heap_init()
+{
+    /*
+	 * As many pages as fit in the heap along with their tree, leaving
+	 * room to align the first page. The first guess leaves room for the
+	 * largest possible tree, and is rarely off by more than a few pages.
+	 * The pages start on a 4K boundary, so that every block up to 4K is
+	 * aligned to its own size (the slab allocator relies on this).
+	 */
+    uint32_t num = (HEAP_SIZE - PAGE_SIZE_4K) >> PAGE_ORDER_256B;
+    num = (HEAP_SIZE - PAGE_SIZE_4K - buddy_meta_size(num)) >> PAGE_ORDER_256B;
+    while (buddy_meta_size(num + 1) + PAGE_SIZE_4K +
+           (num + 1) * PAGE_SIZE_256B <= HEAP_SIZE) {
+        num++;
+    }
+
+    buddy_sys = buddy_new(num, HEAP_START);
+    _alloc_start = _align_page(HEAP_START + buddy_meta_size(num), PAGE_ORDER_4K);
+    _alloc_end = _alloc_start + num * PAGE_SIZE_256B;
+}
+
+static void _heap_dump()
+{
+    printf("\t_alloc_start = %x, _alloc_end = %x, num of pages = %d\n", _alloc_start, _alloc_end, buddy_sys->avail);
+}
+
+/*
+ * Allocate a memory block which is composed of contiguous physical pages
+ * - size: the number of bytes to allocate, rounded up to a power of 2
+ *   number of 256B pages
+ */
+static void *_heap_alloc(uint32_t size)
+{
+    uint32_t npages = (size + PAGE_SIZE_256B - 1) >> PAGE_ORDER_256B;
+
+    if (npages == 0) {
+        return NULL;
+    }
+
+    int offset = buddy_alloc(buddy_sys, npages);
+    if (offset < 0) {
+        return NULL;
+    }
+    return (void *) (_alloc_start + (offset << PAGE_ORDER_256B));
+}
+
+/*
+ * Free the memory block
+ * - p: start address of the memory block
+ */
+static void _heap_free(void *p)
+{
+    if (!p || (uint32_t)p < _alloc_start || (uint32_t)p >= _alloc_end ||
+        ((uint32_t)p & (PAGE_SIZE_256B - 1))) {
+        return;
+    }
+    buddy_free(buddy_sys, ((uint32_t)p - _alloc_start) >> PAGE_ORDER_256B);
+}
+
+/*
+ * Per-hart caches hold order 0 (256B) and order 4 (4K) blocks, that is
+ * every request up to 256 bytes and every request above 2K up to 4K.
+ */
+static inline int _size_class(uint32_t size)
+{
+    if (size <= PAGE_SIZE_256B) {
+        return PAGE_CLASS_256B;
+    }
+    if (size > PAGE_SIZE_4K / 2 && size <= PAGE_SIZE_4K) {
+        return PAGE_CLASS_4K;
+    }
+    return -1;
+}
+
+/*
+ * Cache class of an allocated block, or -1 if it is neither 256B nor 4K.
+ * buddy_size only walks the tree nodes below and at the allocated node,
+ * which nobody else changes while we own the block, so no lock is needed.
+ */
+static inline int _block_class(void *p)
+{
+    if ((uint32_t)p < _alloc_start || (uint32_t)p >= _alloc_end ||
+        ((uint32_t)p & (PAGE_SIZE_256B - 1))) {
+        return -1;
+    }
+    int size = buddy_size(buddy_sys, ((uint32_t)p - _alloc_start) >> PAGE_ORDER_256B);
+    if (size == 1) {
+        return PAGE_CLASS_256B;
+    }
+    if (size == PAGE_SIZE_4K / PAGE_SIZE_256B) {
+        return PAGE_CLASS_4K;
+    }
+    return -1;
+}
+
+static void _heap_stats(struct page_stats *st)
+{
+    st->total = buddy_sys->avail << PAGE_ORDER_256B;
+    st->used = buddy_sys->used << PAGE_ORDER_256B;
+    st->peak = buddy_sys->peak << PAGE_ORDER_256B;
+    st->largest_free = buddy_longest(buddy_sys) << PAGE_ORDER_256B;
+}
+
+#endif /* CONFIG_BUDDY */
+
+/*
+ * Per-hart page caches (magazines)
+ * Each hart keeps up to MAG_SIZE recently freed blocks of each cache
+ * class. page_alloc and page_free only touch the cache of the current
+ * hart, with interrupts masked so that the caller is neither preempted
+ * nor moved to another hart meanwhile, so the common path needs no lock.
+ * The heap and zero locks are taken with interrupts masked too, since
+ * traps allocate as well. When a cache runs empty or
+ * full, MAG_BATCH blocks are moved from or to the heap at once, under
+ * heap_lock.
+ * Blocks sitting in a cache are still allocated as far as the heap is
+ * concerned.
+ */
+#define MAG_SIZE 32
+#define MAG_BATCH (MAG_SIZE / 2)
+
+struct magazine {
+    uint32_t count;
+    void *blocks[MAG_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct magazine mags[MAXNUM_CPU][NR_PAGE_CLASSES];
+
+/*
+ * Per-hart counters, each padded to whole cache lines like the magazines,
+ * so that the fast path does not share cache lines between harts.
+ * latency[k] counts the page_alloc calls that took [2^k, 2^(k+1)) cycles.
+ */
+struct page_counters {
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    uint32_t latency[PAGE_LAT_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct page_counters counters[MAXNUM_CPU];
+static const uint32_t class_size[NR_PAGE_CLASSES] = {
+    PAGE_SIZE_256B, PAGE_SIZE_4K,
+};
+
+static struct spinlock heap_lock;
+
+static void _mag_refill(struct magazine *mag, int class)
+{
+    spinlock_acquire(&heap_lock);
+    while (mag->count < MAG_BATCH) {
+        void *p = _heap_alloc(class_size[class]);
+        if (!p) {
             break;
-        } else {
-            _clear(page);
-            page++;
+        }
+        mag->blocks[mag->count++] = p;
+    }
+    spinlock_release(&heap_lock);
+}
+
+static void _mag_drain(struct magazine *mag)
+{
+    spinlock_acquire(&heap_lock);
+    while (mag->count > MAG_SIZE - MAG_BATCH) {
+        _heap_free(mag->blocks[--mag->count]);
+    }
+    spinlock_release(&heap_lock);
+}
+
+/* clear size bytes from p on, a word at a time; p is page aligned */
+static void _page_clear(void *p, uint32_t size)
+{
+    uint32_t *w = (uint32_t *) p;
+    uint32_t n = (size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+    while (n--) {
+        *w++ = 0;
+    }
+}
+
+static void *_page_alloc(uint32_t size)
+{
+    /* the caches would hand out a 256B block, the heap does not */
+    if (size == 0) {
+        return NULL;
+    }
+
+    int class = _size_class(size);
+
+    if (class >= 0) {
+        struct magazine *mag = &mags[r_mhartid()][class];
+        if (!mag->count) {
+            _mag_refill(mag, class);
+        }
+        return mag->count ? mag->blocks[--mag->count] : NULL;
+    }
+
+    spinlock_acquire(&heap_lock);
+    void *p = _heap_alloc(size);
+    spinlock_release(&heap_lock);
+    return p;
+}
+
+static inline int _lat_bucket(uint32_t cycles)
+{
+    int k = 0;
+    while (cycles >>= 1) {
+        k++;
+    }
+    return (k < PAGE_LAT_BUCKETS) ? k : PAGE_LAT_BUCKETS - 1;
+}
+
+static void _page_free(void *p)
+{
+    int class = _block_class(p);
+
+    if (class >= 0) {
+        struct magazine *mag = &mags[r_mhartid()][class];
+        if (mag->count == MAG_SIZE) {
+            _mag_drain(mag);
+        }
+        mag->blocks[mag->count++] = p;
+        return;
+    }
+
+    spinlock_acquire(&heap_lock);
+    _heap_free(p);
+    spinlock_release(&heap_lock);
+}
+
+/*
+ * Pre-zeroed pages
+ * page_alloc_zeroed takes single pages of either cache class from these
+ * stacks, which page_zero_refill fills up again when the hart has nothing
+ * else to do. Requests of other sizes, or made while the stack is empty,
+ * are cleared on the spot.
+ * Like the page caches, blocks sitting here are allocated as far as the
+ * heap is concerned.
+ */
+#define ZERO_POOL_SIZE 16
+
+struct zero_pool {
+    uint32_t count;
+    void *blocks[ZERO_POOL_SIZE];
+};
+
+static struct zero_pool zeroed[NR_PAGE_CLASSES];
+static struct spinlock zero_lock;
+
+static void *_zero_take(uint32_t size)
+{
+    int class = _size_class(size);
+    void *p = NULL;
+
+    if (size == 0 || class < 0) {
+        return NULL;
+    }
+    spinlock_acquire(&zero_lock);
+    if (zeroed[class].count) {
+        p = zeroed[class].blocks[--zeroed[class].count];
+    }
+    spinlock_release(&zero_lock);
+    return p;
+}
+
+/*
+ * DESCRIPTION
+ * 	Clear one page for page_alloc_zeroed, if the pre-zeroed pool has room
+ * 	for it. Meant for the idle loop: interrupts are only disabled while
+ * 	the page is taken from the allocator, not while it is cleared.
+ * RETURN VALUE
+ * 	1: a page was added to the pool
+ * 	0: the pool is full, or the heap is out of pages
+ */
+int page_zero_refill()
+{
+    for (int class = 0; class < NR_PAGE_CLASSES; class++) {
+        struct zero_pool *zp = &zeroed[class];
+        if (zp->count >= ZERO_POOL_SIZE) {
+            continue;
+        }
+
+        reg_t mstatus = r_mstatus();
+        w_mstatus(mstatus & ~MSTATUS_MIE);
+        void *p = _page_alloc(class_size[class]);
+        w_mstatus(mstatus);
+        if (!p) {
+            return 0;
+        }
+
+        _page_clear(p, class_size[class]);
+
+        w_mstatus(mstatus & ~MSTATUS_MIE);
+        spinlock_acquire(&zero_lock);
+        if (zp->count < ZERO_POOL_SIZE) {
+            zp->blocks[zp->count++] = p;
+            p = NULL;
+        }
+        spinlock_release(&zero_lock);
+        if (p) {
+            /* another hart filled the pool meanwhile */
+            _page_free(p);
+        }
+        w_mstatus(mstatus);
+        return 1;
+    }
+    return 0;
+}
+
+static inline void _count_alloc(uint32_t start, void *p)
+{
+    struct page_counters *c = &counters[r_mhartid()];
+
+    c->latency[_lat_bucket(r_mcycle() - start)]++;
+    c->allocs++;
+    if (!p) {
+        c->failures++;
+    }
+}
+
+/*
+ * Allocate a memory block which is composed of contiguous physical pages
+ * - size: the number of bytes to allocate
+ */
+void *page_alloc(uint32_t size)
+{
+    reg_t mstatus = r_mstatus();
+    w_mstatus(mstatus & ~MSTATUS_MIE);
+
+    uint32_t start = r_mcycle();
+
+    void *p = _page_alloc(size);
+
+    _count_alloc(start, p);
+    w_mstatus(mstatus);
+    return p;
+}
+
+/*
+ * Allocate a memory block like page_alloc, with its first size bytes
+ * cleared.
+ */
+void *page_alloc_zeroed(uint32_t size)
+{
+    reg_t mstatus = r_mstatus();
+    w_mstatus(mstatus & ~MSTATUS_MIE);
+
+    uint32_t start = r_mcycle();
+    int clear = 0;
+
+    void *p = _zero_take(size);
+    if (!p) {
+        p = _page_alloc(size);
+        clear = (p != NULL);
+    }
+
+    _count_alloc(start, p);
+    w_mstatus(mstatus);
+
+    /* the block is ours, clear it with interrupts on */
+    if (clear) {
+        _page_clear(p, size);
+    }
+    return p;
+}
+
+/*
+ * Free the memory block
+ * - p: start address of the memory block
+ */
+void page_free(void *p)
+{
+    if (!p) {
+        return;
+    }
+
+    reg_t mstatus = r_mstatus();
+    w_mstatus(mstatus & ~MSTATUS_MIE);
+    counters[r_mhartid()].frees++;
+    _page_free(p);
+    w_mstatus(mstatus);
+}
+
+/*
+ * Collect the allocator statistics. Counters of other harts may be read
+ * while they change, which only makes the snapshot slightly stale.
+ */
+void page_get_stats(struct page_stats *st)
+{
+    spinlock_acquire(&heap_lock);
+    _heap_stats(st);
+    spinlock_release(&heap_lock);
+
+    st->allocs = 0;
+    st->frees = 0;
+    st->failures = 0;
+    st->cached = 0;
+    st->zeroed = 0;
+    for (int k = 0; k < PAGE_LAT_BUCKETS; k++) {
+        st->latency[k] = 0;
+    }
+
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        st->allocs += counters[i].allocs;
+        st->frees += counters[i].frees;
+        st->failures += counters[i].failures;
+        for (int k = 0; k < PAGE_LAT_BUCKETS; k++) {
+            st->latency[k] += counters[i].latency[k];
+        }
+        for (int class = 0; class < NR_PAGE_CLASSES; class++) {
+            st->cached += mags[i][class].count * class_size[class];
+        }
+    }
+    for (int class = 0; class < NR_PAGE_CLASSES; class++) {
+        st->zeroed += zeroed[class].count * class_size[class];
+    }
+}
+
+void page_stats_dump()
+{
+    struct page_stats st;
+    page_get_stats(&st);
+
+    printf("page allocator:\n");
+    printf("\tallocs = %d, frees = %d, failures = %d\n", st.allocs, st.frees, st.failures);
+    printf("\ttotal = %d, used = %d (cached = %d, zeroed = %d), peak = %d, largest free = %d\n",
+           st.total, st.used, st.cached, st.zeroed, st.peak, st.largest_free);
+    printf("\tpage_alloc cycles:\n");
+    for (int k = 0; k < PAGE_LAT_BUCKETS; k++) {
+        if (st.latency[k]) {
+            printf("\t\t< %d: %d\n", 2 << k, st.latency[k]);
         }
     }
 }
 
+void page_init()
+{
+    printf("HEAP_START: 0x%x, HEAP_SIZE: 0x%x\n", HEAP_START, HEAP_SIZE);
+
+    _heap_init();
+
+    printf("TEXT:   0x%x -> 0x%x\n", TEXT_START, TEXT_END);
+	printf("RODATA: 0x%x -> 0x%x\n", RODATA_START, RODATA_END);
+	printf("DATA:   0x%x -> 0x%x\n", DATA_START, DATA_END);
+	printf("BSS:    0x%x -> 0x%x\n", BSS_START, BSS_END);
+	printf("HEAP:\n");
+    _heap_dump();
+}
+
 void page_test()
 {
-    // 4K page test
-    void *p = page_alloc(2, _num_pages_4k);
-    printf("4k p = 0x%x\n", p);
+    void *p = page_alloc(2 * PAGE_SIZE_4K);
+    printf("8k p = 0x%x\n", p);
 
-    void *p2 = page_alloc(7, _num_pages_4k);
-    printf("4k p2 = 0x%x\n", p2);
-    page_free(p2, _num_pages_4k);
+    void *p2 = page_alloc(7 * PAGE_SIZE_4K);
+    printf("28k p2 = 0x%x\n", p2);
+    page_free(p2);
 
-    void *p3 = page_alloc(4, _num_pages_4k);
-    printf("4k p3 = 0x%x\n", p3);
+    void *p3 = page_alloc(4 * PAGE_SIZE_4K);
+    printf("16k p3 = 0x%x\n", p3);
 
-    // 256B page test
-    void *p4 = page_alloc(4, _num_pages_256b);
-    printf("256b p4 = 0x%x\n", p4);
+    void *p4 = page_alloc(4 * PAGE_SIZE_256B);
+    printf("1k p4 = 0x%x\n", p4);
 
-    void *p5 = page_alloc(7, _num_pages_256b);
-    printf("256b p5 = 0x%x\n", p5);
-    page_free(p5, _num_pages_256b);
+    void *p5 = page_alloc(7 * PAGE_SIZE_256B);
+    printf("1.75k p5 = 0x%x\n", p5);
+    page_free(p5);
 
-    void *p6 = page_alloc(7, _num_pages_256b);
-    printf("256b p6 = 0x%x\n", p6);
+    void *p6 = page_alloc(7 * PAGE_SIZE_256B);
+    printf("1.75k p6 = 0x%x\n", p6);
 }
\ No newline at end of file
@@ -8,6 +8,15 @@
  */
 #define MAXNUM_CPU 8
 
+/*
+ * Each hart boots on its own stack, and handles its traps on it once the
+ * tasks run.
+ */
+#define HART_STACK_SIZE 4096
+
+/* data written by one hart only is aligned to this, to not share lines */
+#define CACHE_LINE_SIZE 64
+
 /*
  * MemoryMap
  * see https://github.com/qemu/qemu/blob/master/hw/riscv/virt.c, virt_memmap[] 
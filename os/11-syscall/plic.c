@@ -1,8 +1,13 @@
 #include "os.h"
 
+/*
+ * Every hart calls plic_init, but only hart 0 takes the UART interrupt.
+ * The hart id is read from mhartid: in a trap, tp holds the register of
+ * the interrupted task.
+ */
 void plic_init(void)
 {
-    int hart = r_tp();
+    int hart = r_mhartid();
 
     /* 
 	 * Set priority for UART0.
@@ -25,7 +30,7 @@ void plic_init(void)
 	 * Each global interrupt can be enabled by setting the corresponding 
 	 * bit in the enables registers.
 	 */
-    *(uint32_t *) PLIC_MENABLE(hart) = (1 << UART0_IRQ);
+    *(uint32_t *) PLIC_MENABLE(hart) = (hart == 0) ? (1 << UART0_IRQ) : 0;
 
     /* 
 	 * Set priority threshold for UART0.
@@ -56,7 +61,7 @@ void plic_init(void)
  */
 int plic_claim(void)
 {
-    int hart = r_tp();
+    int hart = r_mhartid();
     int irq = *(uint32_t *) PLIC_MCLAIM(hart);
     return irq;
 }
@@ -73,6 +78,6 @@ int plic_claim(void)
  */
 void plic_complete(int irq)
 {
-    int hart = r_tp();
+    int hart = r_mhartid();
     *(uint32_t *) PLIC_MCOMPLETE(hart) = irq;
 }
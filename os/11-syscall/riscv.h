@@ -95,4 +95,12 @@ static inline reg_t r_mcause()
     return x;
 }
 
+/* Machine cycle counter, lower 32 bits */
+static inline reg_t r_mcycle()
+{
+    reg_t x;
+    asm volatile("csrr %0, mcycle" : "=r" (x));
+    return x;
+}
+
 #endif /* _RISCV_H_ */
\ No newline at end of file
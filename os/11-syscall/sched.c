@@ -5,15 +5,287 @@ extern void switch_to(struct context *next);
 
 #define MAX_TASKS 10
 #define STACK_SIZE 1024
-uint8_t task_stack[MAX_TASKS][STACK_SIZE];
-struct context ctx_tasks[MAX_TASKS];
+
+#define TASK_READY 0
+#define TASK_DEAD 1
+#define TASK_SLEEPING 2
+#define TASK_WAITING 3		/* a periodic task waiting for its next release */
+
+/*
+ * Stacks are filled with STACK_MAGIC when created, so the deepest point a
+ * task ever reached is where the pattern stops, scanning up from the
+ * bottom. The lowest STACK_GUARD bytes are checked on every tick, to warn
+ * while an overflow is still ahead.
+ */
+#define STACK_MAGIC 0x5aa5c33c
+#define STACK_GUARD 128
+
+/* priorities, 0 is the highest */
+#define NR_PRIO 32
+
+/* default time slice, 10ms */
+#define SLICE_TICKS (HZ / 100)
+
+#ifdef CONFIG_FAIR
+/*
+ * Fair share
+ * Instead of FIFO queues by priority, each hart keeps its ready tasks in
+ * a min-heap ordered by virtual runtime: the mtime a task actually ran
+ * for, measured at every switch and tick, scaled by NR_PRIO / weight,
+ * where weight = NR_PRIO - priority. The least served task runs next, so
+ * a task which traps out early is only charged for what it used. A task
+ * made ready is put at most FAIR_CREDIT behind min_vruntime, the virtual
+ * time of its hart, so that a long sleep does not buy it the whole hart.
+ * The running task is preempted at the end of its slice, or once it is
+ * FAIR_GRAN ahead of the least served ready task.
+ */
+#define FAIR_CREDIT (CLINT_TIMEBASE_FREQ / 100)
+#define FAIR_GRAN (CLINT_TIMEBASE_FREQ / 1000)
+#endif
+
+#ifdef CONFIG_MLFQ
+#ifdef CONFIG_FAIR
+#error "MLFQ and FAIR are exclusive"
+#endif
+/*
+ * Multi-level feedback queue
+ * Tasks are queued by a level which the scheduler sets, rather than by
+ * their priority. Every task starts at level 0, the highest. A task
+ * switched out at the end of its slice goes down a level, one which
+ * blocks before its slice ends goes up a level. The slice doubles with
+ * each level down, so long running tasks switch less often while those
+ * waiting on the UART or a sleep get the CPU first. Every MLFQ_BOOST
+ * ticks, all the tasks are put back to level 0, so that none starves.
+ */
+#define MLFQ_LEVELS 4
+#define MLFQ_BOOST HZ
+#endif
+
+/* mtime per ms, for the accounting */
+#define MTIME_PER_MS (CLINT_TIMEBASE_FREQ / 1000)
+
+/* bound on the summed budget / deadline of the periodic tasks, per mille */
+#define EDF_UTIL_MAX 1000
+
+/*
+ * Task control block
+ * - ctx: must stay first, mscratch points to it while the task runs
+ * - stack, stack_size: the stack, allocated from the page allocator
+ * - stack_warned: the guard of the stack has been hit
+ * - next: link in the ready queue of its priority, in the sleep queue,
+ *   or in the free slot list once the task is dead
+ * - cpu: the hart whose ready queue holds the task, or which runs it
+ * - wake_tick: the tick a sleeping task wakes up at
+ * - slice: ticks the task runs for before the next ready task of its
+ *   priority gets the CPU
+ * - slice_end: the tick the current slice of the running task ends at
+ * - period, budget, deadline: in ticks, for periodic tasks only, period
+ *   is 0 for the others. A job is released every period, must complete
+ *   within deadline and runs for at most budget ticks.
+ * - release: the tick the next job is released at
+ * - abs_deadline: the tick the current job must complete by
+ * - used: ticks the current job has run for, up to run_start
+ * - run_start: the tick the task was last switched to
+ * - util: budget / deadline, per mille, reserved at admission
+ * - misses: jobs which completed after their deadline, or were held back
+ *   past it as overruns
+ * - overruns: jobs which used up their budget and were held back until
+ *   the next release
+ * - run_since: mtime the task was last switched to, or charged at
+ * - vruntime, heap_idx: virtual runtime, and place in the ready heap of
+ *   its hart, with FAIR
+ * - level: the queue of the task, with MLFQ
+ * - stats: its accounting, run_frac and trap_frac hold what is short of
+ *   a ms yet
+ * - giving_up: the task called task_yield or task_exit, so the switch is
+ *   voluntary. One killed by another task is switched out involuntarily.
+ */
+struct task {
+    struct context ctx;
+    uint8_t *stack;
+    uint32_t stack_size;
+    int stack_warned;
+    int state;
+    uint8_t priority;
+    struct task *next;
+    int cpu;
+    uint32_t wake_tick;
+    uint32_t slice;
+    uint32_t slice_end;
+    uint32_t period;
+    uint32_t budget;
+    uint32_t deadline;
+    uint32_t release;
+    uint32_t abs_deadline;
+    uint32_t used;
+    uint32_t run_start;
+    uint32_t util;
+    uint32_t misses;
+    uint32_t overruns;
+    uint32_t run_since;
+#ifdef CONFIG_FAIR
+    uint32_t vruntime;
+    int heap_idx;
+#endif
+#ifdef CONFIG_MLFQ
+    uint8_t level;
+#endif
+    struct task_stats stats;
+    uint32_t run_frac;
+    uint32_t trap_frac;
+    int giving_up;
+};
+
+struct task tasks[MAX_TASKS];
+
+/*
+ * Ready queues
+ * Each hart has one FIFO queue per priority, holding its ready tasks but
+ * the running one, and bit k of its ready_bitmap is set if the queue of
+ * priority k is not empty. The running task goes back to the tail of its
+ * queue when it is switched out, so tasks of the same priority take turns.
+ */
+struct ready_queue {
+    struct task *head;
+    struct task *tail;
+};
+
+/*
+ * Per-hart scheduler state
+ * - current: the task running on the hart, -1 while its idle task runs
+ * - zombie: a dead task whose stack is still to be freed, with SYSCALL=n
+ * - ready, ready_bitmap, nr_ready: the ready queues of the hart
+ * - heap, min_vruntime: the ready heap of the hart, with FAIR
+ * - idle: the idle task of the hart, and the time it ran
+ */
+struct cpu {
+    int online;
+    int current;
+    int zombie;
+#ifdef CONFIG_FAIR
+    struct task *heap[MAX_TASKS];
+    uint32_t min_vruntime;
+#else
+    struct ready_queue ready[NR_PRIO];
+    uint32_t ready_bitmap;
+#endif
+    uint32_t nr_ready;
+    struct task idle;
+    int idle_running;
+    uint32_t idle_since;	/* mtime idle last started running at */
+    uint32_t idle_time;		/* mtime spent in idle, since the last report */
+    int in_trap;		/* in a trap, taken at trap_since */
+    uint32_t trap_since;
+};
+
+static struct cpu cpus[MAXNUM_CPU];
+
+/*
+ * sched_lock guards tasks[], all the ready queues and the sleep queue.
+ * It is taken with interrupts masked, the timer and software interrupt
+ * handlers take it too.
+ */
+static struct spinlock sched_lock;
+
+static reg_t _sched_lock()
+{
+    reg_t mstatus = r_mstatus();
+    w_mstatus(mstatus & ~MSTATUS_MIE);
+    spinlock_acquire(&sched_lock);
+    return mstatus;
+}
+
+static void _sched_unlock(reg_t mstatus)
+{
+    spinlock_release(&sched_lock);
+    w_mstatus(mstatus);
+}
+
+static inline struct cpu *_this_cpu()
+{
+    return &cpus[r_mhartid()];
+}
 
 /*
- * _top is used to mark the max available position of ctx_tasks
- * _current is used to point to the context of current task
+ * Sleep queue
+ * The sleeping tasks, sorted by the tick they wake up at, so that
+ * timer_handler only looks at the head. Periodic tasks wait here for
+ * their next release.
+ */
+static struct task *_sleepers = NULL;
+
+/*
+ * Earliest deadline first
+ * Periodic tasks form a class above all the priorities: a hart runs the
+ * ready periodic task with the earliest deadline, if any, before any
+ * other task. Their ready queue is shared by the harts and sorted by
+ * deadline. Admission keeps the summed density (budget / deadline) of the
+ * periodic tasks within 1, which is enough for global EDF to meet all the
+ * deadlines on any number of harts, as long as jobs stay within budget.
+ */
+static struct task *_edf_ready = NULL;
+static uint32_t _edf_util = 0;		/* per mille, of the admitted tasks */
+
+/*
+ * _top is used to mark the max available position of tasks
+ * _free_slots lists the slots below _top of the dead tasks, to be reused
  */
 static int _top = 0;
-static int _current = -1;
+static struct task *_free_slots = NULL;
+
+#ifdef CONFIG_SYSCALL
+/* defined in usys.S, issue the system calls from user mode */
+extern void exit(void);
+extern int waitperiod(void);
+#define TASK_RETURN exit
+#define TASK_WAIT_PERIOD waitperiod
+#define TASK_MPP 0
+#else
+#define TASK_RETURN task_exit
+#define TASK_WAIT_PERIOD task_wait_period
+#define TASK_MPP MSTATUS_MPP
+#endif
+
+/*
+ * Idle task
+ * Each hart has one. It runs, in machine mode, when the hart finds no
+ * ready task, and is not part of tasks[]: current is -1 while it runs.
+ * It clears pages for page_alloc_zeroed, then waits for interrupts with
+ * wfi, until a software interrupt tells it a task was made ready for it.
+ * The time it runs is accounted in mtime units; every UTIL_TICKS ticks
+ * the share of the time the harts were busy is printed.
+ */
+#define IDLE_STACK_SIZE 1024
+#define UTIL_TICKS (10 * HZ)
+
+static uint32_t _util_since;	/* mtime of the last report */
+static uint32_t _util_tick = 0;	/* tick of the last report */
+
+static void _task_reap(struct cpu *c);
+
+static void _idle_loop()
+{
+    while (1) {
+        if (_this_cpu()->zombie >= 0) {
+            /* the task which exited into idle left its stack behind */
+            reg_t mstatus = _sched_lock();
+            _task_reap(_this_cpu());
+            _sched_unlock(mstatus);
+        }
+        if (!page_zero_refill()) {
+            asm volatile("wfi");
+        }
+    }
+}
+
+/* add the time the idle task of c ran so far to its idle_time */
+static void _idle_account(struct cpu *c, uint32_t now)
+{
+    if (c->idle_running) {
+        c->idle_time += now - c->idle_since;
+        c->idle_since = now;
+    }
+}
 
 static void w_mcsratch(reg_t x)
 {
@@ -21,50 +293,1096 @@ static void w_mcsratch(reg_t x)
 }
 
 
-void sched_init()
+/* set up the scheduler on the calling hart, after sched_init on hart 0 */
+void sched_init_hart()
 {
+    struct cpu *c = _this_cpu();
+
     w_mcsratch(0);
 
+    c->idle.stack = page_alloc(IDLE_STACK_SIZE);
+    if (!c->idle.stack) {
+        panic("sched_init: out of memory");
+    }
+    c->idle.stack_size = IDLE_STACK_SIZE;
+    c->idle.state = TASK_READY;
+    c->idle.ctx.sp = (reg_t) (c->idle.stack + IDLE_STACK_SIZE);
+    c->idle.ctx.pc = (reg_t) _idle_loop;
+    c->current = -1;
+    c->zombie = -1;
+
     /* enable machine-mode software interrupts. */
 	w_mie(r_mie() | MIE_MSIE);
+
+    reg_t mstatus = _sched_lock();
+    c->online = 1;
+    _sched_unlock(mstatus);
+}
+
+void sched_init()
+{
+    _util_since = r_mtime();
+    sched_init_hart();
+}
+
+/* tick a comes before tick b, even across the wrap of the tick counter */
+static inline int _tick_before(uint32_t a, uint32_t b)
+{
+    return (int) (a - b) < 0;
+}
+
+static void _edf_insert(struct task *t)
+{
+    struct task **pp = &_edf_ready;
+
+    /* after the tasks of the same deadline, for fairness */
+    while (*pp && !_tick_before(t->abs_deadline, (*pp)->abs_deadline)) {
+        pp = &(*pp)->next;
+    }
+    t->next = *pp;
+    *pp = t;
+}
+
+static void _edf_remove(struct task *t)
+{
+    for (struct task **pp = &_edf_ready; *pp; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+}
+
+/* start the job released at t->release */
+static void _job_start(struct task *t)
+{
+    t->abs_deadline = t->release + t->deadline;
+    t->release += t->period;
+    t->used = 0;
 }
 
+#ifdef CONFIG_FAIR
+static inline uint32_t _fair_weight(struct task *t)
+{
+    return NR_PRIO - t->priority;
+}
+
+/* virtual runtime a comes before b, even across the wrap */
+static inline int _vbefore(uint32_t a, uint32_t b)
+{
+    return (int) (a - b) < 0;
+}
+
+static void _heap_swap(struct cpu *c, int i, int j)
+{
+    struct task *t = c->heap[i];
+
+    c->heap[i] = c->heap[j];
+    c->heap[j] = t;
+    c->heap[i]->heap_idx = i;
+    c->heap[j]->heap_idx = j;
+}
+
+static void _heap_up(struct cpu *c, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!_vbefore(c->heap[i]->vruntime, c->heap[parent]->vruntime)) {
+            break;
+        }
+        _heap_swap(c, i, parent);
+        i = parent;
+    }
+}
+
+static void _heap_down(struct cpu *c, int i)
+{
+    int n = c->nr_ready;
+
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < n && _vbefore(c->heap[l]->vruntime, c->heap[min]->vruntime)) {
+            min = l;
+        }
+        if (r < n && _vbefore(c->heap[r]->vruntime, c->heap[min]->vruntime)) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        _heap_swap(c, i, min);
+        i = min;
+    }
+}
+
+/* take the task at index i out of the heap */
+static void _heap_take(struct cpu *c, int i)
+{
+    struct task *last = c->heap[--c->nr_ready];
+
+    if (i < c->nr_ready) {
+        c->heap[i] = last;
+        last->heap_idx = i;
+        _heap_up(c, i);
+        _heap_down(c, last->heap_idx);
+    }
+}
+
+static void _ready_push(struct cpu *c, struct task *t)
+{
+    uint32_t floor = c->min_vruntime - FAIR_CREDIT;
+
+    if (_vbefore(t->vruntime, floor)) {
+        t->vruntime = floor;
+    }
+    t->cpu = c - cpus;
+    t->heap_idx = c->nr_ready;
+    c->heap[c->nr_ready++] = t;
+    _heap_up(c, t->heap_idx);
+}
+
+/* take the least served task, there must be one */
+static struct task *_ready_pop(struct cpu *c)
+{
+    struct task *t = c->heap[0];
+
+    _heap_take(c, 0);
+    if (_vbefore(c->min_vruntime, t->vruntime)) {
+        c->min_vruntime = t->vruntime;
+    }
+    return t;
+}
+
+static void _ready_remove(struct task *t)
+{
+    if (t->period) {
+        _edf_remove(t);
+        return;
+    }
+    _heap_take(&cpus[t->cpu], t->heap_idx);
+}
+
+/* the least served ready task of c is far enough behind cur */
+static int _ready_preempts(struct cpu *c, struct task *cur)
+{
+    return c->nr_ready && _vbefore(c->heap[0]->vruntime + FAIR_GRAN, cur->vruntime);
+}
+#else
+/* the ready queue of t */
+static inline uint8_t _prio(struct task *t)
+{
+#ifdef CONFIG_MLFQ
+    return t->level;
+#else
+    return t->priority;
+#endif
+}
+
+static void _ready_push(struct cpu *c, struct task *t)
+{
+    struct ready_queue *q = &c->ready[_prio(t)];
+
+    t->cpu = c - cpus;
+    t->next = NULL;
+    if (q->tail) {
+        q->tail->next = t;
+    } else {
+        q->head = t;
+    }
+    q->tail = t;
+    c->ready_bitmap |= (1U << _prio(t));
+    c->nr_ready++;
+}
+
+/* take the first task of the highest priority queue, there must be one */
+static struct task *_ready_pop(struct cpu *c)
+{
+    int prio = ffs32(c->ready_bitmap);
+    struct ready_queue *q = &c->ready[prio];
+    struct task *t = q->head;
+
+    q->head = t->next;
+    if (!q->head) {
+        q->tail = NULL;
+        c->ready_bitmap &= ~(1U << prio);
+    }
+    c->nr_ready--;
+    return t;
+}
+
+/* take a task off its ready queue, the queue is at most MAX_TASKS long */
+static void _ready_remove(struct task *t)
+{
+    if (t->period) {
+        _edf_remove(t);
+        return;
+    }
+
+    struct cpu *c = &cpus[t->cpu];
+    struct ready_queue *q = &c->ready[_prio(t)];
+    struct task *prev = NULL;
+
+    for (struct task *p = q->head; p; prev = p, p = p->next) {
+        if (p != t) {
+            continue;
+        }
+        if (prev) {
+            prev->next = t->next;
+        } else {
+            q->head = t->next;
+        }
+        if (q->tail == t) {
+            q->tail = prev;
+        }
+        c->nr_ready--;
+        break;
+    }
+    if (!q->head) {
+        c->ready_bitmap &= ~(1U << _prio(t));
+    }
+}
+
+/* a ready task of c has a higher priority than cur */
+static int _ready_preempts(struct cpu *c, struct task *cur)
+{
+    return c->ready_bitmap && ffs32(c->ready_bitmap) < _prio(cur);
+}
+#endif
+
+#ifdef CONFIG_MLFQ
+static uint32_t _mlfq_boosted = 0;	/* tick of the last boost */
+
+/* put every task back to level 0, requeueing the ready ones */
+static void _mlfq_boost()
+{
+    for (int i = 0; i < _top; i++) {
+        struct task *t = &tasks[i];
+        if (t->state == TASK_DEAD || t->period || t->level == 0) {
+            continue;
+        }
+        if (t->state == TASK_READY && cpus[t->cpu].current != i) {
+            _ready_remove(t);
+            t->level = 0;
+            _ready_push(&cpus[t->cpu], t);
+        } else {
+            t->level = 0;
+        }
+    }
+}
+#endif
+
+/* add d of mtime to a counter in ms, frac keeps what is short of a ms */
+static void _add_mtime(uint32_t *ms, uint32_t *frac, uint32_t d)
+{
+    *frac += d;
+    *ms += *frac / MTIME_PER_MS;
+    *frac %= MTIME_PER_MS;
+}
+
+/* charge t for the time it ran since run_since */
+static void _charge(struct task *t, uint32_t now)
+{
+#ifdef CONFIG_FAIR
+    /* divide first, delta * NR_PRIO overflows past 13s of mtime */
+    uint32_t delta = now - t->run_since, w = _fair_weight(t);
+    t->vruntime += delta / w * NR_PRIO + delta % w * NR_PRIO / w;
+#endif
+    _add_mtime(&t->stats.run_ms, &t->run_frac, now - t->run_since);
+    t->run_since = now;
+}
+
+/* charge the task running on c for the trap it is in, up to now */
+static void _charge_trap(struct cpu *c, uint32_t now)
+{
+    if (c->in_trap && c->current >= 0) {
+        struct task *t = &tasks[c->current];
+        _add_mtime(&t->stats.trap_ms, &t->trap_frac, now - c->trap_since);
+    }
+    c->trap_since = now;
+}
+
+/*
+ * Called by trap_handler on entry and on return. The accounting of a
+ * task is only written by the hart running it, so no lock is taken.
+ */
+void sched_trap_enter()
+{
+    struct cpu *c = _this_cpu();
+    c->in_trap = 1;
+    c->trap_since = r_mtime();
+}
+
+void sched_trap_exit()
+{
+    struct cpu *c = _this_cpu();
+    _charge_trap(c, r_mtime());
+    c->in_trap = 0;
+}
+
+/* have hart take a software interrupt, which makes it call schedule() */
+static void _kick(int hart)
+{
+    *(uint32_t *) CLINT_MSIP(hart) = 1;
+}
+
+/*
+ * Queue a periodic task, and kick the hart it should preempt: an idle
+ * one, else one running a task of another class, else the one running
+ * the periodic task with the latest deadline, if later than that of t.
+ */
+static void _edf_wake(struct task *t)
+{
+    int target = -1, target_rank = -1;
+    uint32_t target_deadline = 0;
+
+    _edf_insert(t);
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        struct cpu *c = &cpus[i];
+        int rank;
+        uint32_t deadline = 0;
+
+        if (!c->online) {
+            continue;
+        }
+        if (c->current < 0) {
+            rank = 2;
+        } else if (!tasks[c->current].period) {
+            rank = 1;
+        } else {
+            rank = 0;
+            deadline = tasks[c->current].abs_deadline;
+        }
+        if (rank > target_rank ||
+            (rank == 0 && target_rank == 0 && _tick_before(target_deadline, deadline))) {
+            target = i;
+            target_rank = rank;
+            target_deadline = deadline;
+        }
+    }
+    if (target >= 0 && (target_rank > 0 || _tick_before(t->abs_deadline, target_deadline))) {
+        _kick(target);
+    }
+}
+
+/* the hart t is made ready on: an idle one, else the one it last ran on */
+static int _wake_target(struct task *t)
+{
+    int target = cpus[t->cpu].online ? t->cpu : (int) r_mhartid();
+
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        if (cpus[i].online && cpus[i].current < 0 && !cpus[i].nr_ready) {
+            target = i;
+            break;
+        }
+    }
+    return target;
+}
+
+/*
+ * Make t ready on a hart: an idle one if there is any, so that it starts
+ * right away, else the one it last ran on. That hart is kicked if it is
+ * another one and it runs its idle task or a task of a lower priority.
+ */
+static void _task_wake(struct task *t)
+{
+    if (t->period) {
+        _edf_wake(t);
+        return;
+    }
+
+    int hart = r_mhartid();
+    int target = _wake_target(t);
+    struct cpu *c = &cpus[target];
+    _ready_push(c, t);
+    if (target != hart && (c->current < 0 || _ready_preempts(c, &tasks[c->current]))) {
+        _kick(target);
+    }
+}
+
+/*
+ * Work stealing
+ * Move the first ready task of the hart with the most of them to c, if c
+ * has nothing else to run or that hart is at least two tasks ahead.
+ */
+static void _balance(struct cpu *c)
+{
+    struct cpu *busiest = NULL;
+
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        struct cpu *o = &cpus[i];
+        if (o != c && o->nr_ready && (!busiest || o->nr_ready > busiest->nr_ready)) {
+            busiest = o;
+        }
+    }
+    if (!busiest) {
+        return;
+    }
+    if (c->nr_ready == 0 || busiest->nr_ready >= c->nr_ready + 2) {
+        _ready_push(c, _ready_pop(busiest));
+    }
+}
+
+static void _sleep_insert(struct task *t)
+{
+    struct task **pp = &_sleepers;
+
+    /* after the tasks waking up at the same tick, for fairness */
+    while (*pp && !_tick_before(t->wake_tick, (*pp)->wake_tick)) {
+        pp = &(*pp)->next;
+    }
+    t->next = *pp;
+    *pp = t;
+
+    if (_sleepers == t) {
+        timer_wake_changed();
+    }
+}
+
+static void _sleep_remove(struct task *t)
+{
+    for (struct task **pp = &_sleepers; *pp; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+}
+
+/* give the stack and the slot of a dead task back */
+static void _task_release(struct task *t)
+{
+    _edf_util -= t->util;
+    t->util = 0;
+    t->period = 0;
+    page_free(t->stack);
+    t->stack = NULL;
+    t->next = _free_slots;
+    _free_slots = t;
+}
+
+/*
+ * Traps are handled on the stack of the hart, but tasks in machine mode
+ * call task_exit on their own stack, so a dead task cannot free its stack
+ * right away. It is freed by the next schedule on the same hart.
+ */
+static void _task_reap(struct cpu *c)
+{
+    if (c->zombie >= 0 && c->zombie != c->current) {
+        _task_release(&tasks[c->zombie]);
+        c->zombie = -1;
+    }
+}
+
+/* the privilege mode mret switches to: machine for the idle task */
+static void _set_mpp(reg_t mpp)
+{
+    w_mstatus((r_mstatus() & ~MSTATUS_MPP) | mpp);
+}
+
+/*
+ * Switch the calling hart to its next task. The current task goes where
+ * its state says: back to the ready queue, to the sleep queue, or away if
+ * it was killed meanwhile. Its context is saved already, so another hart
+ * may pick it up as soon as sched_lock is released.
+ */
 void schedule()
 {
-    if (_top <= 0) {
-        panic("Number of task should be greater than 0!\n");
+    struct cpu *c = _this_cpu();
+
+    /* task_exit in machine mode gets here with interrupts on */
+    w_mstatus(r_mstatus() & ~MSTATUS_MIE);
+    spinlock_acquire(&sched_lock);
+
+    uint32_t now = r_mtime();
+    uint32_t tick = timer_get_tick();
+
+    _task_reap(c);
+
+    if (c->current >= 0) {
+        struct task *t = &tasks[c->current];
+        _charge(t, now);
+        _charge_trap(c, now);
+        if (t->giving_up || t->state == TASK_SLEEPING || t->state == TASK_WAITING) {
+            t->stats.voluntary++;
+        } else {
+            t->stats.involuntary++;
+        }
+        t->giving_up = 0;
+        if (t->period) {
+            t->used += tick - t->run_start;
+        }
+#ifdef CONFIG_MLFQ
+        if (!t->period && t->state != TASK_READY && _tick_before(tick, t->slice_end)) {
+            /* blocked early */
+            if (t->level > 0) {
+                t->level--;
+            }
+        } else if (!t->period && t->state == TASK_READY && !_tick_before(tick, t->slice_end)) {
+            /* used the whole slice */
+            if (t->level < MLFQ_LEVELS - 1) {
+                t->level++;
+            }
+        }
+#endif
+        if (t->state == TASK_DEAD) {
+#ifdef CONFIG_SYSCALL
+            /* we run on the hart stack, its own is not in use any more */
+            _task_release(t);
+#else
+            /* task_exit runs on the stack of the task, free it later */
+            c->zombie = c->current;
+#endif
+        } else if (t->state == TASK_SLEEPING || t->state == TASK_WAITING) {
+            _sleep_insert(t);
+        } else if (t->period && t->used >= t->budget) {
+            /*
+             * Out of budget, hold the job back until the next release.
+             * That is past its deadline, so it is a miss too. What is
+             * left of it then runs as part of the next job.
+             */
+            t->overruns++;
+            t->misses++;
+            t->state = TASK_WAITING;
+            t->wake_tick = t->release;
+            _sleep_insert(t);
+        } else if (t->period) {
+            _edf_insert(t);
+        } else {
+            _ready_push(c, t);
+        }
+    }
+
+    _balance(c);
+
+    if (!_edf_ready && !c->nr_ready) {
+        if (!c->idle_running) {
+            c->idle_running = 1;
+            c->idle_since = now;
+        }
+        c->current = -1;
+        c->in_trap = 0;
+        spinlock_release(&sched_lock);
+        _set_mpp(MSTATUS_MPP);
+        timer_slice_start(0);
+        switch_to(&c->idle.ctx);
+    }
+
+    _idle_account(c, now);
+    c->idle_running = 0;
+
+    struct task *next;
+    uint32_t slice;
+    if (_edf_ready) {
+        next = _edf_ready;
+        _edf_ready = next->next;
+        next->run_start = tick;
+        slice = next->budget - next->used;
+    } else {
+        next = _ready_pop(c);
+        slice = next->slice;
+#ifdef CONFIG_MLFQ
+        slice <<= next->level;
+#endif
+    }
+    c->current = next - tasks;
+    next->cpu = c - cpus;
+    next->run_since = now;
+    next->stats.switches++;
+    c->in_trap = 0;
+    next->slice_end = timer_slice_start(slice);
+    spinlock_release(&sched_lock);
+    _set_mpp(TASK_MPP);
+    switch_to(&next->ctx);
+}
+
+/*
+ * Called on every timer interrupt. The running task keeps the hart until
+ * its slice is used up, unless a task of a higher priority is ready on
+ * it, or a periodic task. A periodic task keeps it until its budget is
+ * used up, unless a periodic task of an earlier deadline is ready. The
+ * idle task gives it up as soon as any hart has a ready task.
+ */
+void sched_tick(uint32_t tick)
+{
+    struct cpu *c = _this_cpu();
+    int resched = 0;
+
+    spinlock_acquire(&sched_lock);
+#ifdef CONFIG_MLFQ
+    if (c == &cpus[0] && tick - _mlfq_boosted >= MLFQ_BOOST) {
+        _mlfq_boosted = tick;
+        _mlfq_boost();
+    }
+#endif
+    if (c->current >= 0) {
+        _charge(&tasks[c->current], r_mtime());
+    }
+    if (c->current < 0) {
+        resched = (_edf_ready != NULL);
+        for (int i = 0; i < MAXNUM_CPU; i++) {
+            if (cpus[i].nr_ready) {
+                resched = 1;
+            }
+        }
+    } else if (tasks[c->current].period) {
+        struct task *t = &tasks[c->current];
+        resched = (t->used + (tick - t->run_start) >= t->budget) ||
+                  (_edf_ready && _tick_before(_edf_ready->abs_deadline, t->abs_deadline));
+    } else {
+        struct task *t = &tasks[c->current];
+        resched = !_tick_before(tick, t->slice_end) || _edf_ready ||
+                  _ready_preempts(c, t);
     }
+    spinlock_release(&sched_lock);
 
-    _current = (_current + 1) % _top;
-    struct  context *next = &(ctx_tasks[_current]);
-    switch_to(next);
+    if (resched) {
+        schedule();
+    }
+}
+
+/* switch away from the current task, which is going to sleep */
+static void _block()
+{
+#ifdef CONFIG_SYSCALL
+    /*
+	 * Tasks run in user mode and get here through a system call, whose
+	 * trap already saved their context: switch away right now.
+	 */
+    schedule();
+#else
+    /*
+	 * Have the software interrupt save the context and switch away. If
+	 * a timer interrupt does it first, the software interrupt is taken
+	 * once the task runs again, as a plain yield.
+	 */
+    task_yield();
+#endif
+}
+
+/*
+ * Print the share of time the harts were busy, every UTIL_TICKS ticks.
+ * Called on every timer interrupt of hart 0, which in tickless mode may
+ * come several ticks apart.
+ */
+void sched_util_report(uint32_t tick)
+{
+    uint32_t ticks = tick - _util_tick;
+    if (ticks < UTIL_TICKS) {
+        return;
+    }
+
+    spinlock_acquire(&sched_lock);
+    uint32_t now = r_mtime();
+    uint32_t idle_time = 0;
+    int n = 0;
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        struct cpu *c = &cpus[i];
+        if (!c->online) {
+            continue;
+        }
+        _idle_account(c, now);
+        idle_time += c->idle_time;
+        c->idle_time = 0;
+        n++;
+    }
+    spinlock_release(&sched_lock);
+
+    uint32_t span = (now - _util_since) / 100 * n;
+    uint32_t idle = span ? idle_time / span : 100;
+    if (idle > 100) {
+        idle = 100;
+    }
+    printf("cpu: busy %d pct of the last %d ticks on %d harts\n", 100 - idle, ticks, n);
+
+    for (int i = 0; i < _top; i++) {
+        struct task *t = &tasks[i];
+        if (t->state != TASK_DEAD && t->period) {
+            printf("task %d: %d deadline misses, %d overruns\n", i, t->misses, t->overruns);
+        }
+    }
+    for (int i = 0; i < _top; i++) {
+        struct task *t = &tasks[i];
+        if (t->state != TASK_DEAD) {
+            printf("task %d: run %d ms (%d in traps), %d switches, %d voluntary, %d involuntary\n",
+                   i, t->stats.run_ms, t->stats.trap_ms, t->stats.switches,
+                   t->stats.voluntary, t->stats.involuntary);
+        }
+    }
+
+    _util_since = now;
+    _util_tick = tick;
+}
+
+/*
+ * Set up a task in a free slot and make it ready. entry is called with
+ * arg; the task is periodic if period is not 0, after admission.
+ */
+static int _task_spawn(void (*entry)(void), reg_t arg, uint8_t priority, uint32_t stack_size,
+                       uint32_t period, uint32_t budget, uint32_t deadline)
+{
+    /* the stack pointer must stay 16-byte aligned */
+    if (stack_size == 0) {
+        stack_size = STACK_SIZE;
+    } else if (stack_size < 2 * STACK_GUARD) {
+        stack_size = 2 * STACK_GUARD;
+    }
+    stack_size = (stack_size + 15) & ~15;
+
+    uint8_t *stack = page_alloc(stack_size);
+    if (!stack) {
+        return -1;
+    }
+    for (uint32_t *w = (uint32_t *) stack; w < (uint32_t *) (stack + stack_size); w++) {
+        *w = STACK_MAGIC;
+    }
+
+    uint32_t util = period ? (budget * 1000 + deadline - 1) / deadline : 0;
+    uint32_t tick = timer_get_tick();
+
+    reg_t mstatus = _sched_lock();
+    if ((!_free_slots && _top >= MAX_TASKS) || _edf_util + util > EDF_UTIL_MAX) {
+        _sched_unlock(mstatus);
+        page_free(stack);
+        return -1;
+    }
+
+    struct task *t;
+    if (_free_slots) {
+        t = _free_slots;
+        _free_slots = t->next;
+    } else {
+        t = &tasks[_top++];
+    }
+
+    /* a reused slot still holds the registers of its last task */
+    reg_t *regs = (reg_t *) &t->ctx;
+    for (int i = 0; i < sizeof(struct context) / sizeof(reg_t); i++) {
+        regs[i] = 0;
+    }
+
+    t->stack = stack;
+    t->stack_size = stack_size;
+    t->stack_warned = 0;
+    t->state = TASK_READY;
+    t->priority = priority;
+    t->slice = SLICE_TICKS;
+#ifdef CONFIG_MLFQ
+    t->level = 0;
+#endif
+    t->period = period;
+    t->budget = budget;
+    t->deadline = deadline;
+    t->util = util;
+    t->misses = 0;
+    t->overruns = 0;
+    t->stats = (struct task_stats) { 0 };
+    t->run_frac = 0;
+    t->trap_frac = 0;
+    t->giving_up = 0;
+    if (period) {
+        _edf_util += util;
+        t->release = tick;
+        _job_start(t);
+    }
+    t->ctx.sp = (reg_t) (stack + stack_size);
+    t->ctx.pc = (reg_t) entry;
+    t->ctx.ra = (reg_t) TASK_RETURN;
+    t->ctx.a0 = arg;
+    t->cpu = r_mhartid();
+#ifdef CONFIG_FAIR
+    /* a reused slot still holds the virtual runtime of its last task */
+    t->vruntime = cpus[_wake_target(t)].min_vruntime;
+#endif
+    _task_wake(t);
+    _sched_unlock(mstatus);
+    return t - tasks;
 }
 
 /*
  * DESCRIPTION
  * 	Create a task.
  * 	- start_routin: task routine entry
+ * 	- priority: from 0 (the highest) to NR_PRIO - 1. The highest priority
+ * 	  ready task always runs, tasks of the same priority take turns.
+ * 	  With FAIR, tasks get the CPU in proportion to NR_PRIO - priority.
+ * 	  With MLFQ, it is not used: the scheduler sets the level of tasks
+ * 	  from how they use their slice.
+ * 	- stack_size: size of the stack in bytes, STACK_SIZE if 0
+ * 	When start_routin returns, the task exits and its stack is freed.
+ * 	The slots of dead tasks are reused first.
  * RETURN VALUE
- * 	0: success
+ * 	the id of the task, to pass to task_kill
  * 	-1: if error occured
  */
-int task_create(void (* start_routin) (void))
+int task_create(void (* start_routin) (void), uint8_t priority, uint32_t stack_size)
 {
-    if (_top < MAX_TASKS) {
-        ctx_tasks[_top].sp = (reg_t) &task_stack[_top][STACK_SIZE - 1];
-		ctx_tasks[_top].pc = (reg_t) start_routin;
-		_top++;
-		return 0;
-    } else {
+    if (priority >= NR_PRIO) {
+        return -1;
+    }
+    return _task_spawn(start_routin, 0, priority, stack_size, 0, 0, 0);
+}
+
+/* body of the periodic tasks, in the mode of the tasks: one job a period */
+static void _periodic_loop(void (*job)(void))
+{
+    while (1) {
+        job();
+        TASK_WAIT_PERIOD();
+    }
+}
+
+/*
+ * DESCRIPTION
+ * 	Create a periodic task, scheduled earliest deadline first ahead of
+ * 	all the other tasks. Its first job is released right away.
+ * 	- job: called once per period, it must return within budget
+ * 	- period: ticks between two releases
+ * 	- budget: ticks a job may run for, a job running longer is held back
+ * 	  until the next release
+ * 	- deadline: ticks after its release a job must be done by, at most
+ * 	  period, or 0 for period
+ * RETURN VALUE
+ * 	the id of the task, to pass to task_kill
+ * 	-1: if the parameters are wrong, or the periodic tasks would need
+ * 	more than the CPU time of one hart to meet their deadlines
+ */
+int task_create_periodic(void (*job)(void), uint32_t period, uint32_t budget, uint32_t deadline)
+{
+    if (deadline == 0) {
+        deadline = period;
+    }
+    if (!job || budget == 0 || budget > deadline || deadline > period) {
+        return -1;
+    }
+    return _task_spawn((void (*)(void)) _periodic_loop, (reg_t) job, 0, 0,
+                       period, budget, deadline);
+}
+
+/*
+ * DESCRIPTION
+ * 	Tell that the current job of a periodic task is done, and wait for
+ * 	the next release. A job done after its deadline is counted as a miss.
+ * 	If the next release has passed already, the next job starts right
+ * 	away. Nothing happens for a task which is not periodic.
+ */
+void task_wait_period()
+{
+    uint32_t tick = timer_get_tick();
+    reg_t mstatus = _sched_lock();
+    struct task *t = &tasks[_this_cpu()->current];
+
+    if (!t->period) {
+        _sched_unlock(mstatus);
+        return;
+    }
+    if (_tick_before(t->abs_deadline, tick)) {
+        t->misses++;
+    }
+    if (!_tick_before(tick, t->release)) {
+        /* the next job starts right away, its time counts from now */
+        _job_start(t);
+        t->run_start = tick;
+        _sched_unlock(mstatus);
+        return;
+    }
+
+    t->state = TASK_WAITING;
+    t->wake_tick = t->release;
+    _sched_unlock(mstatus);
+
+    _block();
+}
+
+/*
+ * DESCRIPTION
+ * 	Deadline misses of a periodic task.
+ * 	- id: the task, or -1 for the current one
+ * RETURN VALUE
+ * 	the number of jobs done after their deadline, or held back past it
+ * 	-1: if there is no such task, or it is not periodic
+ */
+int task_deadline_misses(int id)
+{
+    if (id < 0) {
+        id = _this_cpu()->current;
+    }
+    if (id < 0 || id >= _top || tasks[id].state == TASK_DEAD || !tasks[id].period) {
+        return -1;
+    }
+    return tasks[id].misses;
+}
+
+/*
+ * DESCRIPTION
+ * 	CPU accounting of a task since it was created. The time of a task
+ * 	running on a hart is brought up to date at each tick.
+ * 	- id: the task, or -1 for the current one
+ * 	- st: filled with the counters
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if there is no such task
+ */
+int task_get_stats(int id, struct task_stats *st)
+{
+    reg_t mstatus = _sched_lock();
+
+    if (id < 0) {
+        id = _this_cpu()->current;
+    }
+    if (id < 0 || id >= _top || tasks[id].state == TASK_DEAD) {
+        _sched_unlock(mstatus);
+        return -1;
+    }
+    *st = tasks[id].stats;
+    _sched_unlock(mstatus);
+    return 0;
+}
+
+/*
+ * DESCRIPTION
+ * 	Terminate the current task and switch to the next one. This is where
+ * 	a task routine returns to (through the exit system call when tasks
+ * 	run in user mode).
+ */
+void task_exit()
+{
+    /* tasks in machine mode get here with interrupts enabled */
+    _sched_lock();
+    tasks[_this_cpu()->current].state = TASK_DEAD;
+    tasks[_this_cpu()->current].giving_up = 1;
+    spinlock_release(&sched_lock);
+
+    /* schedule() frees the stack, once off it in machine mode */
+    schedule();
+}
+
+/*
+ * DESCRIPTION
+ * 	Terminate a task. Its slot may be reused right away by task_create,
+ * 	so the id must not be used again afterwards. A task running on
+ * 	another hart is stopped by that hart, at its next schedule.
+ * 	- id: the task, as returned by task_create
+ * RETURN VALUE
+ * 	0: success, it does not return if id is the current task
+ * 	-1: if there is no such task
+ */
+int task_kill(int id)
+{
+    reg_t mstatus = _sched_lock();
+
+    if (id < 0 || id >= _top || tasks[id].state == TASK_DEAD) {
+        _sched_unlock(mstatus);
         return -1;
     }
+    if (id == _this_cpu()->current) {
+        _sched_unlock(mstatus);
+        task_exit();
+    }
+
+    struct task *t = &tasks[id];
+    if (cpus[t->cpu].current == id) {
+        /* running, or about to sleep, on another hart */
+        t->state = TASK_DEAD;
+        _kick(t->cpu);
+    } else {
+        if (t->state == TASK_SLEEPING || t->state == TASK_WAITING) {
+            _sleep_remove(t);
+        } else {
+            _ready_remove(t);
+        }
+        t->state = TASK_DEAD;
+        _task_release(t);
+    }
+
+    _sched_unlock(mstatus);
+    return 0;
+}
+
+/*
+ * DESCRIPTION
+ * 	Block the current task until the tick counter reaches tick. The CPU
+ * 	goes to the other tasks meanwhile.
+ */
+void task_sleep_until(uint32_t tick)
+{
+    if (!_tick_before(timer_get_tick(), tick)) {
+        return;
+    }
+
+    /*
+	 * The task is still running, schedule() moves it to the sleep queue
+	 * once its context is saved, so no other hart can wake it up before.
+	 */
+    reg_t mstatus = _sched_lock();
+    struct task *t = &tasks[_this_cpu()->current];
+    t->state = TASK_SLEEPING;
+    t->wake_tick = tick;
+    _sched_unlock(mstatus);
+
+    _block();
+}
+
+/*
+ * DESCRIPTION
+ * 	Block the current task for the given number of ticks.
+ */
+void task_sleep(uint32_t ticks)
+{
+    task_sleep_until(timer_get_tick() + ticks);
+}
+
+/*
+ * DESCRIPTION
+ * 	Tell when the next sleeping task is due to wake up, for the tickless
+ * 	timer to program its next interrupt. It is called with the timer lock
+ * 	held, so it does not take sched_lock: tasks[] is never freed, and a
+ * 	task put to sleep meanwhile ahead of the others has hart 0 program
+ * 	its timer again, through timer_wake_changed.
+ * RETURN VALUE
+ * 	1 with the wake up tick in *tick, 0 if no task is sleeping
+ */
+int task_next_wake(uint32_t *tick)
+{
+    struct task *t = *(struct task * volatile *) &_sleepers;
+
+    if (!t) {
+        return 0;
+    }
+    *tick = t->wake_tick;
+    return 1;
+}
+
+/*
+ * Make the tasks whose wake up tick has come ready again.
+ * Called on every timer interrupt of hart 0.
+ */
+void task_wake_sleepers(uint32_t tick)
+{
+    spinlock_acquire(&sched_lock);
+    while (_sleepers && !_tick_before(tick, _sleepers->wake_tick)) {
+        struct task *t = _sleepers;
+        _sleepers = t->next;
+        if (t->state == TASK_WAITING) {
+            _job_start(t);
+        }
+        t->state = TASK_READY;
+        _task_wake(t);
+    }
+    spinlock_release(&sched_lock);
 }
 
 void task_yield()
 {   
+    /* masked, so that the task stays on this hart until the interrupt */
+    reg_t mstatus = _sched_lock();
+    struct cpu *c = _this_cpu();
+    if (c->current >= 0) {
+        tasks[c->current].giving_up = 1;
+    }
+
     /* trigger a machine-level software interrupt */
-    int id = r_mhartid();
-    *(uint32_t *) CLINT_MSIP(id) = 1;
+    _kick(c - cpus);
+    _sched_unlock(mstatus);
 }
 
 /*
@@ -75,3 +1393,98 @@ void task_delay(volatile int count)
 	count *= 50000;
 	while (count--);
 }
+
+/*
+ * DESCRIPTION
+ * 	Set the time slice of a task, which is SLICE_TICKS when created.
+ * 	Longer slices mean fewer switches, shorter ones a quicker turn for
+ * 	the other tasks of the same priority. It applies from the next time
+ * 	the task is switched to. With MLFQ, it is the slice at level 0 and
+ * 	doubles with each level down.
+ * 	- id: the task, or -1 for the current one
+ * 	- ticks: the slice, at least 1
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if there is no such task or ticks is 0
+ */
+int task_set_slice(int id, uint32_t ticks)
+{
+    reg_t mstatus = _sched_lock();
+
+    if (id < 0) {
+        id = _this_cpu()->current;
+    }
+    if (id < 0 || id >= _top || tasks[id].state == TASK_DEAD || ticks == 0) {
+        _sched_unlock(mstatus);
+        return -1;
+    }
+
+    tasks[id].slice = ticks;
+    _sched_unlock(mstatus);
+    return 0;
+}
+
+/* peak stack usage of t, with sched_lock held */
+static int _stack_usage(struct task *t)
+{
+    uint32_t *w = (uint32_t *) t->stack;
+    uint32_t n = t->stack_size / sizeof(uint32_t);
+    uint32_t i = 0;
+
+    while (i < n && w[i] == STACK_MAGIC) {
+        i++;
+    }
+    return (n - i) * sizeof(uint32_t);
+}
+
+/*
+ * DESCRIPTION
+ * 	Peak stack usage of a task.
+ * 	- id: the task, as returned by task_create, or -1 for the current one
+ * RETURN VALUE
+ * 	the number of bytes of stack the task has used at most
+ * 	-1: if there is no such task
+ */
+int task_stack_usage(int id)
+{
+    reg_t mstatus = _sched_lock();
+
+    if (id < 0) {
+        id = _this_cpu()->current;
+    }
+    if (id < 0 || id >= _top || tasks[id].state == TASK_DEAD) {
+        _sched_unlock(mstatus);
+        return -1;
+    }
+
+    /* task_kill frees the stack under the lock */
+    int used = _stack_usage(&tasks[id]);
+    _sched_unlock(mstatus);
+    return used;
+}
+
+/*
+ * Warn, once per task, about the tasks whose stack reached its guard.
+ * Called on every timer interrupt of hart 0.
+ */
+void task_stack_check()
+{
+    spinlock_acquire(&sched_lock);
+    for (int i = 0; i < _top; i++) {
+        struct task *t = &tasks[i];
+        if (t->state == TASK_DEAD || t->stack_warned) {
+            continue;
+        }
+
+        uint32_t *w = (uint32_t *) t->stack;
+        for (int k = 0; k < STACK_GUARD / sizeof(uint32_t); k++) {
+            if (w[k] != STACK_MAGIC) {
+                printf("WARNING: task %d has used %d of its %d bytes of stack\n",
+                       i, _stack_usage(t), t->stack_size);
+                t->stack_warned = 1;
+                break;
+            }
+        }
+    }
+    spinlock_release(&sched_lock);
+}
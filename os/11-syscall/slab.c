@@ -0,0 +1,472 @@
+#include "os.h"
+
+/*
+ * Slab allocator for fixed-size kernel objects, built on top of page_alloc.
+ *
+ * A cache hands out objects of one size. Its memory comes in slabs: one
+ * 256B page for small objects, one 4K page for the others. Each slab
+ * starts with a struct slab header followed by the objects, and the free
+ * objects of a slab are chained through a link word, so both
+ * kmem_cache_alloc and kmem_cache_free are a pointer pop/push.
+ *
+ * The constructor of a cache runs once per object, when its slab is
+ * created. Objects must be given back in their constructed state. For
+ * such caches the link word is kept right after the object, so that it
+ * does not clobber constructed fields; otherwise it reuses the first word.
+ *
+ * Caches of large objects (KMEM_OFF_SLAB) keep the struct slab in a
+ * separate cache instead, so that power of 2 sized objects fill their 4K
+ * slab exactly. Their objects are mapped back to the slab through
+ * _frame_owner, which records the slab of every 4K frame.
+ *
+ * kmalloc/kfree sit on top: a set of caches for power of 2 sizes from
+ * 16 to 2048 bytes, all with 4K slabs so kfree can find the cache of any
+ * pointer in _frame_owner.
+ *
+ * Every cache has its own lock, taken with interrupts masked as objects
+ * are allocated and freed from traps on any hart. The lock of a cache may
+ * be held while taking the one of slab_cache, never the other way round.
+ * cache_cache is set up by the first kmem_cache_create, which runs at
+ * boot on hart 0 before the other harts start.
+ */
+
+/* defined in mem.S */
+extern uint32_t HEAP_START;
+extern uint32_t HEAP_SIZE;
+
+#define SLAB_SMALL 256
+#define SLAB_LARGE 4096
+
+#define SLAB_LARGE_ORDER 12
+
+/* use a 256B slab only if it holds at least this many objects */
+#define SLAB_SMALL_MIN_OBJS 8
+
+/* cache flags */
+#define KMEM_LARGE_SLAB (1 << 0)   /* always use 4K slabs */
+#define KMEM_OFF_SLAB   (1 << 1)   /* keep struct slab out of the slab */
+
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    struct kmem_cache *cache;
+    void *mem;          /* first object */
+    void *free;         /* list of free objects */
+    uint32_t inuse;     /* number of objects allocated */
+};
+
+/* caches are kmem_cache objects themselves, they come from cache_cache */
+static struct kmem_cache cache_cache;
+
+/* headers of off-slab slabs */
+static struct kmem_cache slab_cache;
+
+/*
+ * _frame_owner[i] is the slab living in the i-th 4K frame of the heap,
+ * or NULL. Set up by kmalloc_init.
+ */
+static struct slab **_frame_owner = NULL;
+static uint32_t _frame_base = 0;
+
+#define KMALLOC_MIN_ORDER 4     /* 16 bytes */
+#define KMALLOC_MAX_ORDER 11    /* 2048 bytes */
+#define NR_KMALLOC_CACHES (KMALLOC_MAX_ORDER - KMALLOC_MIN_ORDER + 1)
+
+/* objects from this size up are kept off-slab */
+#define KMALLOC_OFF_SLAB_ORDER 9
+
+static struct kmem_cache kmalloc_caches[NR_KMALLOC_CACHES];
+static const char *kmalloc_names[NR_KMALLOC_CACHES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static void _list_add(struct slab **head, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = *head;
+    if (s->next) {
+        s->next->prev = s;
+    }
+    *head = s;
+}
+
+static void _list_del(struct slab **head, struct slab *s)
+{
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        *head = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+static reg_t _cache_lock(struct kmem_cache *cache)
+{
+    reg_t mstatus = r_mstatus();
+    w_mstatus(mstatus & ~MSTATUS_MIE);
+    spinlock_acquire(&cache->lock);
+    return mstatus;
+}
+
+static void _cache_unlock(struct kmem_cache *cache, reg_t mstatus)
+{
+    spinlock_release(&cache->lock);
+    w_mstatus(mstatus);
+}
+
+static inline void **_link(struct kmem_cache *cache, void *obj)
+{
+    return (void **) ((uint8_t *) obj + cache->offset);
+}
+
+static inline uint32_t _objs_per_slab(uint32_t slab_size, uint32_t size)
+{
+    return (slab_size - sizeof(struct slab)) / size;
+}
+
+static inline struct slab **_frame(void *p)
+{
+    return &_frame_owner[((uint32_t) p - _frame_base) >> SLAB_LARGE_ORDER];
+}
+
+static void _cache_init(struct kmem_cache *cache, const char *name,
+                        uint32_t size, void (*ctor)(void *obj), uint32_t flags)
+{
+    /* objects hold the free list link and stay word aligned */
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    cache->name = name;
+    cache->ctor = ctor;
+    cache->offset = 0;
+    if (ctor) {
+        cache->offset = size;
+        size += sizeof(void *);
+    }
+    cache->size = size;
+    cache->flags = flags;
+    cache->slab_size = SLAB_SMALL;
+    if ((flags & KMEM_LARGE_SLAB) ||
+        _objs_per_slab(SLAB_SMALL, size) < SLAB_SMALL_MIN_OBJS) {
+        cache->slab_size = SLAB_LARGE;
+    }
+    if (flags & KMEM_OFF_SLAB) {
+        cache->objs_per_slab = cache->slab_size / size;
+    } else {
+        cache->objs_per_slab = _objs_per_slab(cache->slab_size, size);
+    }
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->lock.locked = 0;
+}
+
+/*
+ * Get a fresh slab from the page allocator and construct its objects.
+ * page_alloc returns blocks aligned to their size (up to 4K), so the
+ * slab of an object can be found by masking its address, unless the
+ * header is off-slab.
+ */
+static struct slab *_slab_new(struct kmem_cache *cache)
+{
+    void *mem = page_alloc(cache->slab_size);
+    if (!mem) {
+        return NULL;
+    }
+
+    struct slab *s;
+    if (cache->flags & KMEM_OFF_SLAB) {
+        s = kmem_cache_alloc(&slab_cache);
+        if (!s) {
+            page_free(mem);
+            return NULL;
+        }
+        s->mem = mem;
+    } else {
+        s = (struct slab *) mem;
+        s->mem = s + 1;
+    }
+
+    s->cache = cache;
+    s->inuse = 0;
+    s->free = NULL;
+
+    uint8_t *obj = (uint8_t *) s->mem + (cache->objs_per_slab - 1) * cache->size;
+    for (int i = 0; i < cache->objs_per_slab; i++) {
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *_link(cache, obj) = s->free;
+        s->free = obj;
+        obj -= cache->size;
+    }
+
+    if (_frame_owner && cache->slab_size == SLAB_LARGE) {
+        *_frame(mem) = s;
+    }
+    return s;
+}
+
+static void _slab_destroy(struct kmem_cache *cache, struct slab *s)
+{
+    void *mem = s;
+
+    if (cache->flags & KMEM_OFF_SLAB) {
+        mem = s->mem;
+        kmem_cache_free(&slab_cache, s);
+    }
+    if (_frame_owner && cache->slab_size == SLAB_LARGE) {
+        *_frame(mem) = NULL;
+    }
+    page_free(mem);
+}
+
+static inline struct slab *_slab_of(struct kmem_cache *cache, void *obj)
+{
+    if (cache->flags & KMEM_OFF_SLAB) {
+        return *_frame(obj);
+    }
+    return (struct slab *) ((uint32_t) obj & ~(cache->slab_size - 1));
+}
+
+/*
+ * DESCRIPTION
+ * 	Create a cache of objects.
+ * 	- name: name of the cache, for debugging
+ * 	- size: size of each object in bytes
+ * 	- ctor: called on each object when its slab is created, may be NULL
+ * RETURN VALUE
+ * 	pointer to the cache, or NULL if error occured
+ */
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size,
+                                     void (*ctor)(void *obj))
+{
+    if (size == 0 || size > SLAB_LARGE - sizeof(struct slab)) {
+        return NULL;
+    }
+
+    if (!cache_cache.size) {
+        _cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), NULL, 0);
+    }
+
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        return NULL;
+    }
+    _cache_init(cache, name, size, ctor, 0);
+    if (cache->objs_per_slab == 0) {
+        /* the link word of a ctor cache pushed it past a 4K slab */
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    reg_t mstatus = _cache_lock(cache);
+    struct slab *s = cache->partial;
+
+    if (!s) {
+        s = cache->empty;
+        if (s) {
+            _list_del(&cache->empty, s);
+        } else {
+            s = _slab_new(cache);
+            if (!s) {
+                _cache_unlock(cache, mstatus);
+                return NULL;
+            }
+        }
+        _list_add(&cache->partial, s);
+    }
+
+    void *obj = s->free;
+    s->free = *_link(cache, obj);
+    s->inuse++;
+
+    if (!s->free) {
+        _list_del(&cache->partial, s);
+        _list_add(&cache->full, s);
+    }
+    _cache_unlock(cache, mstatus);
+    return obj;
+}
+
+/*
+ * Give an object back to its cache.
+ * A cache keeps at most one empty slab around; the others are returned
+ * to the page allocator.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    if (!obj) {
+        return;
+    }
+
+    reg_t mstatus = _cache_lock(cache);
+    struct slab *s = _slab_of(cache, obj);
+
+    if (!s->free) {
+        _list_del(&cache->full, s);
+        _list_add(&cache->partial, s);
+    }
+
+    *_link(cache, obj) = s->free;
+    s->free = obj;
+    s->inuse--;
+
+    if (s->inuse == 0) {
+        _list_del(&cache->partial, s);
+        if (cache->empty) {
+            _slab_destroy(cache, s);
+        } else {
+            _list_add(&cache->empty, s);
+        }
+    }
+    _cache_unlock(cache, mstatus);
+}
+
+/*
+ * Set up the kmalloc caches and the 4K frame owner table, which covers
+ * the whole heap with one pointer per 4K frame.
+ */
+void kmalloc_init()
+{
+    _frame_base = HEAP_START & ~(SLAB_LARGE - 1);
+    uint32_t nr_frames = (HEAP_START + HEAP_SIZE - _frame_base + SLAB_LARGE - 1) >> SLAB_LARGE_ORDER;
+    uint32_t size = nr_frames * sizeof(struct slab *);
+
+    struct slab **frames = page_alloc(size);
+    if (!frames) {
+        panic("kmalloc_init: out of memory");
+    }
+    for (int i = 0; i < nr_frames; i++) {
+        frames[i] = NULL;
+    }
+    _frame_owner = frames;
+
+    _cache_init(&slab_cache, "slab", sizeof(struct slab), NULL, 0);
+
+    for (int i = 0; i < NR_KMALLOC_CACHES; i++) {
+        int order = KMALLOC_MIN_ORDER + i;
+        uint32_t flags = KMEM_LARGE_SLAB;
+        if (order >= KMALLOC_OFF_SLAB_ORDER) {
+            flags |= KMEM_OFF_SLAB;
+        }
+        _cache_init(&kmalloc_caches[i], kmalloc_names[i], 1 << order, NULL, flags);
+    }
+}
+
+/* index of the kmalloc cache serving size bytes */
+static inline int _kmalloc_index(uint32_t size)
+{
+    int order = KMALLOC_MIN_ORDER;
+    size = (size - 1) >> KMALLOC_MIN_ORDER;
+    while (size) {
+        size >>= 1;
+        order++;
+    }
+    return order - KMALLOC_MIN_ORDER;
+}
+
+/*
+ * DESCRIPTION
+ * 	Allocate size bytes of kernel memory.
+ * 	Sizes up to 2048 bytes are rounded up to a power of 2 and served by
+ * 	the kmalloc caches, larger ones go straight to page_alloc.
+ * RETURN VALUE
+ * 	pointer to the memory, or NULL if error occured
+ */
+void *kmalloc(uint32_t size)
+{
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > (1 << KMALLOC_MAX_ORDER)) {
+        return page_alloc(size);
+    }
+    return kmem_cache_alloc(&kmalloc_caches[_kmalloc_index(size)]);
+}
+
+void kfree(void *p)
+{
+    if (!p) {
+        return;
+    }
+
+    struct slab *s = *_frame(p);
+    if (s) {
+        kmem_cache_free(s->cache, p);
+    } else {
+        page_free(p);
+    }
+}
+
+#define BENCH_OBJS 64
+#define BENCH_ROUNDS 32
+
+static uint32_t _bench_seed = 1;
+
+static inline uint32_t _bench_rand()
+{
+    _bench_seed = _bench_seed * 1103515245 + 12345;
+    return _bench_seed >> 16;
+}
+
+/*
+ * Boot-time self-benchmark of kmalloc/kfree.
+ * For every size class, allocate and free BENCH_OBJS objects of random
+ * sizes that fall in the class, BENCH_ROUNDS times, and report:
+ * - the throughput in alloc+free pairs per second (from mtime)
+ * - the internal fragmentation: bytes lost to rounding up to the class
+ *   size plus the part of each 4K slab that holds no object
+ */
+void kmalloc_bench()
+{
+    static void *objs[BENCH_OBJS];
+
+    printf("kmalloc benchmark:\n");
+    printf("\tclass\tops/s\t\tfrag (pct)\n");
+
+    for (int i = 0; i < NR_KMALLOC_CACHES; i++) {
+        struct kmem_cache *cache = &kmalloc_caches[i];
+        uint32_t class_size = 1 << (KMALLOC_MIN_ORDER + i);
+        uint32_t min_size = (class_size >> 1) + 1;
+        uint32_t requested = 0;
+        uint32_t ops = 0;
+
+        uint32_t start = r_mtime();
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            for (int k = 0; k < BENCH_OBJS; k++) {
+                uint32_t size = min_size + _bench_rand() % (class_size - min_size + 1);
+                objs[k] = kmalloc(size);
+                requested += size;
+            }
+            for (int k = 0; k < BENCH_OBJS; k++) {
+                kfree(objs[k]);
+            }
+            ops += BENCH_OBJS;
+        }
+        uint32_t elapsed = r_mtime() - start;
+
+        /* elapsed is in 1/CLINT_TIMEBASE_FREQ s, keep the math in 32 bits */
+        uint32_t us = elapsed / (CLINT_TIMEBASE_FREQ / 1000000);
+        uint32_t rate = us ? (ops * 1000 / us) * 1000 : 0;
+
+        uint32_t slab_used = cache->objs_per_slab * cache->size;
+        uint32_t slab_waste = SLAB_LARGE - slab_used;
+        if (!(cache->flags & KMEM_OFF_SLAB)) {
+            slab_waste -= sizeof(struct slab);
+        }
+        uint32_t granted = ops * class_size;
+        uint32_t lost = (granted - requested) + ops * slab_waste / cache->objs_per_slab;
+
+        printf("\t%d\t%d\t\t%d\n", class_size, rate, lost * 100 / (granted + ops * slab_waste / cache->objs_per_slab));
+    }
+}
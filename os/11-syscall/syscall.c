@@ -12,6 +12,55 @@ int sys_gethid(unsigned int *ptr_hid)
     }
 }
 
+int sys_memstat(struct page_stats *st)
+{
+    printf("--> sys_memstat, arg0 = 0x%x\n", st);
+    if (st == NULL) {
+        return -1;
+    }
+    page_get_stats(st);
+    return 0;
+}
+
+void sys_exit()
+{
+    printf("--> sys_exit\n");
+    task_exit();
+}
+
+int sys_stackuse(int id)
+{
+    printf("--> sys_stackuse, arg0 = %d\n", id);
+    return task_stack_usage(id);
+}
+
+int sys_kill(int id)
+{
+    printf("--> sys_kill, arg0 = %d\n", id);
+    return task_kill(id);
+}
+
+void sys_sleep(uint32_t ticks)
+{
+    printf("--> sys_sleep, arg0 = %d\n", ticks);
+    task_sleep(ticks);
+}
+
+void sys_waitperiod()
+{
+    printf("--> sys_waitperiod\n");
+    task_wait_period();
+}
+
+int sys_taskstat(int id, struct task_stats *st)
+{
+    printf("--> sys_taskstat, arg0 = %d, arg1 = 0x%x\n", id, st);
+    if (st == NULL) {
+        return -1;
+    }
+    return task_get_stats(id, st);
+}
+
 void do_syscall(struct context *cxt)
 {
     uint32_t syscall_num = cxt->a7;
@@ -21,6 +70,32 @@ void do_syscall(struct context *cxt)
     case SYS_gethid:
         cxt->a0 = sys_gethid((unsigned int *) (cxt->a0));
         break;
+    case SYS_memstat:
+        cxt->a0 = sys_memstat((struct page_stats *) (cxt->a0));
+        break;
+    case SYS_exit:
+        sys_exit();
+        break;
+    case SYS_stackuse:
+        cxt->a0 = sys_stackuse((int) (cxt->a0));
+        break;
+    case SYS_kill:
+        cxt->a0 = sys_kill((int) (cxt->a0));
+        break;
+    case SYS_sleep: {
+        /* set the result first, the task is switched out while asleep */
+        uint32_t ticks = cxt->a0;
+        cxt->a0 = 0;
+        sys_sleep(ticks);
+        break;
+    }
+    case SYS_waitperiod:
+        cxt->a0 = 0;
+        sys_waitperiod();
+        break;
+    case SYS_taskstat:
+        cxt->a0 = sys_taskstat((int) (cxt->a0), (struct task_stats *) (cxt->a1));
+        break;
     
     default:
         printf("Unknown syscall no: %d\n", syscall_num);
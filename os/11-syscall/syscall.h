@@ -2,5 +2,12 @@
 #define _SYSCALL_H_
 
 #define SYS_gethid 1
+#define SYS_memstat 2
+#define SYS_exit 3
+#define SYS_stackuse 4
+#define SYS_kill 5
+#define SYS_sleep 6
+#define SYS_waitperiod 7
+#define SYS_taskstat 8
 
 #endif /* _SYSCALL_H_ */
\ No newline at end of file
@@ -1,14 +1,145 @@
 #include "os.h"
 
-extern void schedule(void);
 
-/* interval ~= 1s */
-#define TIMER_INTERVAL CLINT_TIMEBASE_FREQ
+/* interval = 1s / HZ */
+#define TIMER_INTERVAL (CLINT_TIMEBASE_FREQ / HZ)
 
 static uint32_t _tick = 0;
+static uint32_t _tick_shown = 0;	/* tick last printed */
 
-#define MAX_TIMER 10
-static struct timer timer_list[MAX_TIMER];
+/*
+ * Active software timers, in no particular order.
+ * Timer objects come from a slab cache instead of a fixed array, so the
+ * number of timers is only bounded by memory.
+ */
+static struct kmem_cache *timer_cache;
+static struct timer *timer_list = NULL;
+
+/*
+ * timer_lock guards the timers and the tick. Every hart takes timer
+ * interrupts to end its time slices, hart 0 also keeps the time: it
+ * counts the ticks, runs the software timers and wakes sleeping tasks.
+ * The scheduler calls in here with its own lock held, so timer_lock is
+ * never held while calling into the scheduler.
+ */
+static struct spinlock timer_lock;
+
+/* interrupts are masked too, timer_handler takes the lock */
+static reg_t _timer_lock()
+{
+    reg_t mstatus = r_mstatus();
+    w_mstatus(mstatus & ~MSTATUS_MIE);
+    spinlock_acquire(&timer_lock);
+    return mstatus;
+}
+
+static void _timer_unlock(reg_t mstatus)
+{
+    spinlock_release(&timer_lock);
+    w_mstatus(mstatus);
+}
+
+#ifdef CONFIG_TICKLESS
+/*
+ * Tickless mode
+ * There is no periodic interrupt. mtimecmp is set to the first moment
+ * something is due: the end of the running task's time slice and, on
+ * hart 0, the next software timer or sleeping task to wake up. When a
+ * hart is idle and nothing is pending, it takes no timer interrupt at all.
+ * _tick still counts TIMER_INTERVAL periods since boot, but it is derived
+ * from mtime instead of counting interrupts.
+ */
+static uint64_t _tick_mtime = 0;	/* mtime at which _tick started */
+static uint64_t _slice_end[MAXNUM_CPU];	/* 0 when no task is running */
+
+/* furthest we program ahead, so that tick arithmetic fits in 32 bits */
+#define TICKS_AHEAD_MAX (0xffffffff / TIMER_INTERVAL)
+
+/* mtime is 64-bit but rv32 reads it in halves, retry if the low half wraps */
+static uint64_t _mtime64()
+{
+    volatile uint32_t *mtime = (volatile uint32_t *) CLINT_MTIME;
+    uint32_t hi, lo;
+
+    do {
+        hi = mtime[1];
+        lo = mtime[0];
+    } while (hi != mtime[1]);
+
+    return ((uint64_t) hi << 32) | lo;
+}
+
+/*
+ * Write mtimecmp without passing through a value lower than both the old
+ * and the new one, which would raise a spurious interrupt.
+ */
+static void _mtimecmp_set(int hart, uint64_t cmp)
+{
+    volatile uint32_t *mtimecmp = (volatile uint32_t *) CLINT_MTIMECMP(hart);
+
+    mtimecmp[1] = 0xffffffff;
+    mtimecmp[0] = (uint32_t) cmp;
+    mtimecmp[1] = (uint32_t) (cmp >> 32);
+}
+
+/* bring _tick up to date with mtime */
+static void _tick_update()
+{
+    uint64_t now = _mtime64();
+
+    while (now - _tick_mtime >= TIMER_INTERVAL) {
+        uint64_t d = now - _tick_mtime;
+        uint32_t n = (d >> 32) ? TICKS_AHEAD_MAX : (uint32_t) d / TIMER_INTERVAL;
+
+        _tick += n;
+        _tick_mtime += n * TIMER_INTERVAL;
+    }
+}
+
+/* mtime at which _tick reaches tick, 0 if it already did */
+static uint64_t _tick_deadline(uint32_t tick)
+{
+    if ((int) (tick - _tick) <= 0) {
+        return 0;
+    }
+
+    uint32_t n = tick - _tick;
+    if (n > TICKS_AHEAD_MAX) {
+        /* too far away, wake up early and program again */
+        n = TICKS_AHEAD_MAX;
+    }
+    return _tick_mtime + n * TIMER_INTERVAL;
+}
+
+/* program the timer interrupt of hart for its earliest pending event */
+static void _timer_program(int hart)
+{
+    uint64_t next = _slice_end[hart] ? _slice_end[hart] : ~0ULL;
+    uint64_t d;
+    uint32_t wake;
+
+    if (hart != 0) {
+        _mtimecmp_set(hart, next);
+        return;
+    }
+
+    for (struct timer *t = timer_list; t; t = t->next) {
+        d = _tick_deadline(t->timeout_tick);
+        if (d < next) {
+            next = d;
+        }
+    }
+    if (task_next_wake(&wake)) {
+        d = _tick_deadline(wake);
+        if (d < next) {
+            next = d;
+        }
+    }
+
+    /* a deadline already passed makes the interrupt pending right away */
+    _mtimecmp_set(hart, next);
+}
+#endif
 
 /* load timer interval(in ticks) for next timer interrupt.*/
 void timer_load(int interval)
@@ -19,100 +150,204 @@ void timer_load(int interval)
     *(uint64_t *) CLINT_MTIMECMP(id) = *(uint64_t *) CLINT_MTIME + interval;
 }
 
-void timer_init()
+/*
+ * DESCRIPTION
+ * 	Called by the scheduler right before it switches to a task, or to the
+ * 	idle task with ticks 0. In tickless mode, the next timer interrupt is
+ * 	programmed for the end of the slice at the latest.
+ * 	- ticks: the time slice of the task
+ * RETURN VALUE
+ * 	the tick the slice ends at
+ */
+uint32_t timer_slice_start(uint32_t ticks)
+{
+#ifdef CONFIG_TICKLESS
+    int hart = r_mhartid();
+    reg_t mstatus = _timer_lock();
+    _tick_update();
+    _slice_end[hart] = ticks ? _tick_deadline(_tick + ticks) : 0;
+    _timer_program(hart);
+    uint32_t end = _tick + ticks;
+    _timer_unlock(mstatus);
+    return end;
+#else
+    return timer_get_tick() + ticks;
+#endif
+}
+
+/*
+ * DESCRIPTION
+ * 	Called by the scheduler when a task becomes the first to wake up.
+ * 	Hart 0 wakes the sleepers, so in tickless mode its next interrupt is
+ * 	programmed again, whichever hart put the task to sleep.
+ */
+void timer_wake_changed()
 {
-    struct timer *t = &(timer_list[0]);
-	for (int i = 0; i < MAX_TIMER; i++) {
-		t->func = NULL; /* use .func to flag if the item is used */
-		t->arg = NULL;
-		t++;
-	}
+#ifdef CONFIG_TICKLESS
+    reg_t mstatus = _timer_lock();
+    _tick_update();
+    _timer_program(0);
+    _timer_unlock(mstatus);
+#endif
+}
 
+/* start the timer interrupts of the calling hart */
+void timer_init_hart()
+{
     /*
 	 * On reset, mtime is cleared to zero, but the mtimecmp registers 
 	 * are not reset. So we have to init the mtimecmp manually.
 	 */
+#ifdef CONFIG_TICKLESS
+    _mtimecmp_set(r_mhartid(), ~0ULL);
+#else
     timer_load(TIMER_INTERVAL);
+#endif
 
     /* enable machine-mode timer interrupts. */
     w_mie(r_mie() | MIE_MTIE);
 }
 
+void timer_init()
+{
+    timer_cache = kmem_cache_create("timer", sizeof(struct timer), NULL);
+    if (!timer_cache) {
+        panic("timer_init: out of memory");
+    }
+
+#ifdef CONFIG_TICKLESS
+    _tick_mtime = _mtime64();
+#endif
+    timer_init_hart();
+}
+
+uint32_t timer_get_tick()
+{
+#ifdef CONFIG_TICKLESS
+    reg_t mstatus = _timer_lock();
+    _tick_update();
+    uint32_t tick = _tick;
+    _timer_unlock(mstatus);
+    return tick;
+#else
+    return _tick;
+#endif
+}
+
 struct timer *timer_create(void (*handler) (void *arg), void *arg, uint32_t timeout)
 {
     if (NULL == handler || 0 == timeout) {
         return NULL;
     }
 
-    spin_lock();
+    reg_t mstatus = _timer_lock();
 
-    struct timer *t = &(timer_list[0]);
-    for (int i = 0; i < MAX_TIMER; i++) {
-        if (NULL == t->func) {
-            break;
-        }
-        t++;
-    }
-    if (NULL != t->func) {
-        spin_unlock();
+    struct timer *t = kmem_cache_alloc(timer_cache);
+    if (NULL == t) {
+        _timer_unlock(mstatus);
         return NULL;
     }
 
+#ifdef CONFIG_TICKLESS
+    _tick_update();
+#endif
+
     t->func = handler;
     t->arg = arg;
     t->timeout_tick = _tick + timeout;
+    t->next = timer_list;
+    timer_list = t;
+
+#ifdef CONFIG_TICKLESS
+    /* the new timer may be due before the interrupt hart 0 programmed */
+    _timer_program(0);
+#endif
 
-    spin_unlock();
+    _timer_unlock(mstatus);
 
     return t;
 }
 
-void timer_delete(struct timer *timer)
+/* unlink timer from timer_list and give it back to the cache */
+static void _timer_remove(struct timer *timer)
 {
-    spin_lock();
-    
-    struct timer *t = &(timer_list[0]);
-    for (int i = 0; i < MAX_TIMER; i++) {
-        if (t == timer) {
-            t->func = NULL;
-            t->arg = NULL;
+    struct timer **pp = &timer_list;
+    while (*pp) {
+        if (*pp == timer) {
+            *pp = timer->next;
+            kmem_cache_free(timer_cache, timer);
             break;
         }
-        t++;
+        pp = &(*pp)->next;
     }
+}
 
-    spin_unlock();
+void timer_delete(struct timer *timer)
+{
+    reg_t mstatus = _timer_lock();
+    _timer_remove(timer);
+    _timer_unlock(mstatus);
 }
 
-/* this routine should be called in interrupt context (interrupt is disabled) */
+/*
+ * this routine should be called in interrupt context (interrupt is disabled)
+ * with timer_lock held, so the handlers must not create or delete timers
+ */
 static inline void timer_check()
 {
-    struct timer *t = &(timer_list[0]);
-    for (int i = 0 ; i < MAX_TIMER; i++) {
-        if (NULL != t->func) {
-            if (_tick >= t->timeout_tick) {
-                t->func(t->arg);
-
-                /* once time, just delete it after timeout */
-                t->func = NULL;
-                t->arg = NULL;
+    struct timer *t = timer_list;
+    while (t) {
+        struct timer *next = t->next;
+        if (_tick >= t->timeout_tick) {
+            t->func(t->arg);
 
-                break;
-            }
+            /* once time, just delete it after timeout */
+            _timer_remove(t);
         }
-        t++;
+        t = next;
     }
 }
 
 void timer_handler()
 {   
-    _tick++;
-    printf("tick: %d\n", _tick);
+    int hart = r_mhartid();
+    uint32_t tick;
+
+    spinlock_acquire(&timer_lock);
+#ifdef CONFIG_TICKLESS
+    _tick_update();
+#else
+    if (hart == 0) {
+        _tick++;
+    }
+#endif
+    tick = _tick;
 
-    timer_check();
+    if (hart == 0) {
+        /* once a second, printing every tick would take most of the CPU */
+        if (tick - _tick_shown >= HZ) {
+            _tick_shown = tick;
+            printf("tick: %d\n", tick);
+        }
+        timer_check();
+    }
+    spinlock_release(&timer_lock);
+
+    if (hart == 0) {
+        task_wake_sleepers(tick);
+        task_stack_check();
+        sched_util_report(tick);
+    }
 
+#ifdef CONFIG_TICKLESS
+    /* mtimecmp has passed, schedule() programs it again if it switches */
+    spinlock_acquire(&timer_lock);
+    _timer_program(hart);
+    spinlock_release(&timer_lock);
+#else
     /* Update next interval */
     timer_load(TIMER_INTERVAL);
+#endif
 
-    schedule();
+    sched_tick(tick);
 }
\ No newline at end of file
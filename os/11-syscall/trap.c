@@ -34,12 +34,14 @@ reg_t trap_handler(reg_t epc, reg_t cause, struct context *cxt)
     reg_t return_pc = epc;
     reg_t cause_code = cause & 0xfff;
 
+    /* the task is charged for the trap, unless the trap switches away */
+    sched_trap_enter();
+
     if (cause & 0x80000000) {
         /* Asynchronous trap - interrupt */
         switch (cause_code)
         {
         case 3:
-            uart_puts(" software interruption!\n");
             /*
 			 * acknowledge the software interrupt by clearing
     		 * the MSIP bit in mip.
@@ -51,7 +53,7 @@ reg_t trap_handler(reg_t epc, reg_t cause, struct context *cxt)
             schedule();
             break;
         case 7:
-            uart_puts(" timer interruption!\n");
+            /* no print here, it would run HZ times a second on every hart */
             timer_handler();
             break;
         case 11:
@@ -67,8 +69,13 @@ reg_t trap_handler(reg_t epc, reg_t cause, struct context *cxt)
         switch (cause_code) {
         case 8:
             uart_puts("System call from U-mode!\n");
-			do_syscall(cxt);
+			/*
+			 * a blocking system call switches to another task, the
+			 * caller then resumes from its context, past the ecall
+			 */
 			return_pc += 4;
+			cxt->pc = return_pc;
+			do_syscall(cxt);
             break;
         default:
             panic("PANIC");
@@ -76,6 +83,8 @@ reg_t trap_handler(reg_t epc, reg_t cause, struct context *cxt)
             break;
         }
     }
+
+    sched_trap_exit();
     return return_pc;
 }
 
@@ -26,11 +26,26 @@ void user_task0(void)
 	} else {
 		printf("gethid() failed, return: %d\n", ret);
 	}
+
+	struct page_stats st;
+	if (!memstat(&st)) {
+		printf("heap: used %d of %d bytes, peak %d\n", st.used, st.total, st.peak);
+	}
+	printf("Task 0: stack used %d bytes\n", stackuse(-1));
+	int rounds = 0;
 #endif
 
 	while (1){
 		uart_puts("Task 0: Running... \n");
-		task_delay(DELAY);
+#ifdef CONFIG_SYSCALL
+		struct task_stats ts;
+		if (++rounds % 10 == 0 && !taskstat(-1, &ts)) {
+			printf("Task 0: ran %d ms over %d switches\n", ts.run_ms, ts.switches);
+		}
+		sleep(HZ);
+#else
+		task_sleep(HZ);
+#endif
 	}
 }
 
@@ -39,13 +54,40 @@ void user_task1(void)
 	uart_puts("Task 1: Created!\n");
 	while (1) {
 		uart_puts("Task 1: Running... \n");
+#ifdef CONFIG_SYSCALL
+		/* give the CPU away instead of spinning */
+		sleep(2 * HZ);
+#else
+		task_sleep(2 * HZ);
+#endif
+	}
+}
+
+void user_task2(void)
+{
+	uart_puts("Task 2: Created!\n");
+	for (int i = 0; i < 3; i++) {
+		uart_puts("Task 2: Running... \n");
 		task_delay(DELAY);
 	}
+	uart_puts("Task 2: Finished!\n");
+}
+
+/* a control loop: one job every 100ms, done within 10ms */
+void user_task3(void)
+{
+	static int jobs = 0;
+
+	if (++jobs % 10 == 0) {
+		uart_puts("Task 3: 10 periods done\n");
+	}
 }
 
 /* NOTICE: DON'T LOOP INFINITELY IN main() */
 void os_main(void)
 {
-	task_create(user_task0);
-	task_create(user_task1);
+	task_create(user_task0, 1, 2048);
+	task_create(user_task1, 1, 1024);
+	task_create(user_task2, 0, 1024);
+	task_create_periodic(user_task3, HZ / 10, HZ / 100, 0);
 }
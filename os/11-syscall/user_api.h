@@ -3,5 +3,12 @@
 
 /* user mode syscall APIs */
 extern int gethid(unsigned int *hid);
+extern int memstat(struct page_stats *st);
+extern void exit(void);
+extern int stackuse(int id);
+extern int kill(int id);
+extern int sleep(unsigned int ticks);
+extern int waitperiod(void);
+extern int taskstat(int id, struct task_stats *st);
 
 #endif /* __USER_API_H__ */